@@ -83,7 +83,7 @@ typedef int64_t NP_Sock;
 /// Increment this every time you break the communications format between the peer and the
 /// NutPuncher, to make it use a different port and retain compatibility with the previous versions
 /// by keeping the old NutPunchers running.
-#define NUTPUNCH_API_VERSION (2)
+#define NUTPUNCH_API_VERSION (7)
 
 /// The UDP port used by the nutpunching mediator server.
 #define NUTPUNCH_SERVER_PORT (30000 + NUTPUNCH_API_VERSION)
@@ -100,19 +100,32 @@ typedef int64_t NP_Sock;
 /// The maximum amount of channels a NutPunch host can send to/receive on.
 #define NUTPUNCH_MAX_CHANNELS (30)
 
-/// Maximum amount of bytes a packet fragment can hold.
-#define NUTPUNCH_FRAGMENT_SIZE (1024) // TODO: actually implement fragmenting
+/// Maximum amount of bytes a packet fragment can hold, until path MTU discovery finds out bigger
+/// ones make it through to a peer. Bigger messages are split into fragments and glued back
+/// together on the receiving end.
+#define NUTPUNCH_FRAGMENT_SIZE (1024)
+
+/// Largest datagram path MTU discovery goes for: a 1500-byte Ethernet frame minus the IPv4 and UDP
+/// headers.
+#define NUTPUNCH_MAX_DATAGRAM_SIZE (1472)
+
+/// Maximum size of a single message passed to `NutPunch_Send` or `NutPunch_SendReliably`.
+#define NUTPUNCH_MAX_MESSAGE_SIZE (65535)
 
 /// How many times to attempt resending a reliable packet.
 #define NUTPUNCH_MAX_RETRIES (16)
 
-/// Initial amount of milliseconds to wait before resending a reliable packet.
-/// The retransmission time will also increase by this much after resending.
+/// Amount of milliseconds to wait before resending a reliable packet while there's no round-trip
+/// time estimate for its recipient yet. The wait doubles after each resend.
 #define NUTPUNCH_RETRY_INTERVAL ((NutPunch_Clock)200)
 
 /// How many milliseconds to wait for a peer or the NutPuncher to respond before timing out.
 #define NUTPUNCH_TIMEOUT_INTERVAL ((NutPunch_Clock)5000)
 
+/// Default amount of milliseconds between heartbeats to the NutPuncher, no matter how often you
+/// call `NutPunch_Update`. See `NutPunch_SetHeartbeatInterval`.
+#define NUTPUNCH_HEARTBEAT_INTERVAL (NUTPUNCH_TIMEOUT_INTERVAL / 20)
+
 #ifndef NUTPUNCH_NOSTD
 #include <stdbool.h>
 #include <stddef.h>
@@ -196,6 +209,11 @@ extern char NP_LastError[512];
 #define NP_Memzero(array) NutPunch_MemSet(array, 0, sizeof(array))
 #define NP_MemzeroRef(ref) NutPunch_MemSet(&(ref), 0, sizeof(ref))
 
+/// Packs a 4-letter packet header into an integer that a `switch` can jump on.
+#define NP_Opcode(a, b, c, d)                                                                      \
+    ((uint32_t)(uint8_t)(a) << 24 | (uint32_t)(uint8_t)(b) << 16 | (uint32_t)(uint8_t)(c) << 8    \
+        | (uint32_t)(uint8_t)(d))
+
 #define NP_Info(...) NutPunch_Log("INFO: " __VA_ARGS__)
 #define NP_Warn(...)                                                                               \
     do {                                                                                           \
@@ -314,6 +332,14 @@ typedef enum {
     NPS_Online,
 } NutPunch_UpdateStatus;
 
+/// How reliable messages on a channel get delivered. See `NutPunch_SetChannelMode`.
+typedef enum {
+    /// As soon as they arrive. This is the default.
+    NPCM_Unordered,
+    /// In the order each peer sent them.
+    NPCM_Ordered,
+} NutPunch_ChannelMode;
+
 typedef enum {
     NPE_Ok,
     NPE_Sybau,
@@ -381,6 +407,18 @@ int NutPunch_ServerPing();
 /// Returns the ping to a peer in milliseconds (0 ms if offline or local/invalid peer).
 int NutPunch_PeerPing(NutPunch_Peer);
 
+/// Returns how much the ping to the NutPuncher tends to vary in milliseconds.
+int NutPunch_ServerJitter();
+
+/// Returns how much the ping to a peer tends to vary in milliseconds.
+int NutPunch_PeerJitter(NutPunch_Peer);
+
+/// Returns the estimated percentage of packets lost on the way to the NutPuncher and back.
+int NutPunch_ServerLoss();
+
+/// Returns the estimated percentage of packets lost on the way to a peer and back.
+int NutPunch_PeerLoss(NutPunch_Peer);
+
 /// Returns the remaining time before getting kicked out of a queue in seconds.
 int NutPunch_QueueTime();
 
@@ -447,11 +485,37 @@ void NutPunch_SetPeerData(const char* name, const char* data);
 /// Setting 0 channels or more than `NUTPUNCH_MAX_CHANNELS` fails silently.
 void NutPunch_SetChannelCount(int);
 
+/// Sets how reliable messages received on the specified channel get delivered. Duplicates of a
+/// reliable message are dropped either way, and unreliable messages aren't affected at all.
+///
+/// `NPCM_Ordered` holds back messages that arrive ahead of a lost one until it gets resent.
+///
+/// Like the channel count, set this up before you host or join a lobby.
+void NutPunch_SetChannelMode(NutPunch_Channel, NutPunch_ChannelMode);
+
+/// Sets how many milliseconds to wait between heartbeats to the NutPuncher. Changes to the lobby
+/// state (metadata, player count etc.) get sent right away regardless.
+///
+/// Clamped between 10 ms and a fifth of `NUTPUNCH_TIMEOUT_INTERVAL`, so a couple of lost
+/// heartbeats don't get you kicked. Defaults to `NUTPUNCH_HEARTBEAT_INTERVAL`.
+void NutPunch_SetHeartbeatInterval(int ms);
+
 /// Checks if there is a packet waiting in the receiving queue for the specified channel index.
 ///
 /// Retrieve message data by calling `NutPunch_NextMessage(channel)`, which see.
 bool NutPunch_HasMessage(NutPunch_Channel);
 
+/// Returns the next packet in the receiving queue for the specified channel index without copying
+/// it out, or `NULL` if there's none. Writes its size into `size` and its sender into `peer` (both
+/// optional).
+///
+/// The data stays valid until you call `NutPunch_ConsumeMessage` on this channel, or
+/// `NutPunch_Update`.
+const void* NutPunch_PeekMessage(NutPunch_Channel, int* size, NutPunch_Peer* peer);
+
+/// Drops the packet returned by `NutPunch_PeekMessage` from the receiving queue.
+void NutPunch_ConsumeMessage(NutPunch_Channel);
+
 /// Retrieves the next packet in the receiving queue for the specified channel index. Reads up to
 /// `size` bytes into `out`. Returns the index of the peer who sent it.
 ///
@@ -464,10 +528,17 @@ int NutPunch_NextMessage(NutPunch_Channel, void* out, int* size);
 
 /// Sends data on the specified channel, to the specified peer. See `NutPunch_SendReliably` for
 /// reliable packet delivery.
+///
+/// Messages up to `NUTPUNCH_MAX_MESSAGE_SIZE` bytes are fine. Ones that don't fit into a single
+/// packet are fragmented, and get dropped as a whole if any of their fragments are lost.
 void NutPunch_Send(NutPunch_Channel, NutPunch_Peer, const void*, int);
 
 /// Sends data on the specified channel, to the specified peer, expecting the remote side to
 /// acknowledge the fact of reception. Resends the packet up to `NUTPUNCH_MAX_RETRIES` times.
+///
+/// The remote side tacks its acks onto whatever it sends back, or sends them on their own after a
+/// short delay if it has nothing to say. Fragments of a big message are acked one by one, so only
+/// the lost ones get resent.
 void NutPunch_SendReliably(NutPunch_Channel, NutPunch_Peer, const void*, int);
 
 /// Counts how many "live" peers we have a route to, including our local peer.
@@ -482,6 +553,11 @@ int NutPunch_PeerCount();
 /// individually using this function.
 bool NutPunch_PeerAlive(NutPunch_Peer);
 
+/// Returns the size of the largest datagram known to make it through to the peer with the
+/// specified index. Starts out at `NUTPUNCH_FRAGMENT_SIZE` and goes up to
+/// `NUTPUNCH_MAX_DATAGRAM_SIZE` as path MTU probes get through. Returns 0 if they aren't alive.
+int NutPunch_PeerMTU(NutPunch_Peer);
+
 /// Returns the local peer's index. Available only after successfully joining a lobby. Returns
 /// `NUTPUNCH_MAX_PLAYERS` if this fails for any reason.
 int NutPunch_LocalPeer();
@@ -592,6 +668,7 @@ typedef struct {
 typedef struct {
     uint8_t unlisted;
     NutPunch_Peer local, master, count, capacity;
+    uint32_t epoch, metadata; // `metadata` is the `NP_HashMetadata` of the lobby's fields
 } NP_Beating;
 
 typedef struct {
@@ -609,6 +686,8 @@ typedef struct {
     NutPunch_LobbyName lobby;
     NP_HeartbeatFlagsStorage flags;
     NP_PeerAddr same_nat;
+    uint32_t epoch;    // of the last BEAT we got, so the NutPuncher can resend one we've missed
+    uint32_t metadata; // `NP_HashMetadata` of the lobby fields appended after this, if any
 } NP_Heartbeat;
 
 typedef struct {
@@ -639,67 +718,201 @@ enum {
 
 #define NUTPUNCH_PING_INTERVAL (1000 * NUTPUNCH_MS)
 
+/// How often to send PEER packets to the other players. The NutPuncher only sends BEATs when
+/// something changes, so these run on their own clock.
+#define NUTPUNCH_NUDGE_INTERVAL (33 * NUTPUNCH_MS)
+
+/// Round-trip time estimator fed by one PING per `NUTPUNCH_PING_INTERVAL`, in the style of TCP's
+/// SRTT/RTTVAR (RFC 6298).
 typedef struct {
-    NutPunch_Clock start, measurements[60];
-    int last_ping;
+    NutPunch_Clock start, srtt, rttvar; // `start` is when the pending probe went out
+    bool answered;
+    uint8_t seq;
+    int loss; // moving average of lost probes in tenths of a percent
 } NP_Pinger;
 
 static NP_Pinger NP_ServerPinger = {0};
 
+/// How long to wait for a path MTU probe to be acked, and how many times to try each size before
+/// deciding it's too big.
+#define NUTPUNCH_PMTU_PROBE_INTERVAL (250 * NUTPUNCH_MS)
+#define NUTPUNCH_PMTU_MAX_PROBES (3)
+
+/// How close in bytes the search has to get to the actual path MTU to call it a day, and how long
+/// to wait before trying to go higher again.
+#define NUTPUNCH_PMTU_PRECISION (16)
+#define NUTPUNCH_PMTU_RAISE_INTERVAL (60 * NUTPUNCH_SEC)
+
+/// How many resends of a reliable packet bigger than `NUTPUNCH_FRAGMENT_SIZE` it takes to suspect
+/// the path got narrower under it.
+#define NUTPUNCH_PMTU_BLACKHOLE_RETRIES (5)
+
+/// Path MTU discovery state of one peer, in the style of DPLPMTUD (RFC 8899): probes padded to a
+/// candidate size go out with the don't-fragment bit set, and `mtu` goes up when one is acked.
+/// `high` is the smallest size known not to make it through.
+typedef struct {
+    uint16_t mtu, high, probe; // `probe` is the size being tried, zero if none
+    uint8_t tries;
+    NutPunch_Clock next; // when to send the next probe or give up on this one
+} NP_PathMTU;
+
+typedef struct NP_OutgoingPacket {
+    NP_SockAddr destination;
+    struct NP_OutgoingPacket* next; // in `NP_Pending` or `NP_FreePackets`
+    int len, retries;
+    NutPunch_Clock last_retry;
+    bool acked;
+    NutPunch_Peer peer; // who a DATA packet is for, so its acks can be filled in when it's sent
+    uint32_t id; // per-peer sequence number, zero for unreliable packets and unsent reliable ones
+    uint8_t data[NUTPUNCH_MAX_DATAGRAM_SIZE];
+} NP_OutgoingPacket;
+
+/// How many unacknowledged reliable packets a peer can have before the oldest ones stop being
+/// tracked, and how far past a hole the receiving end remembers what it got. Must be a multiple
+/// of 64.
+#define NUTPUNCH_ACK_WINDOW (256)
+
+/// Size of the ack state on the wire: the cumulative ack, the 64-bit mask after it, and the oldest
+/// sequence number the sender is still waiting an ack for.
+#define NUTPUNCH_ACKS_SIZE (4 + 8 + 4)
+
+/// How long to sit on an owed ack waiting for some DATA to piggyback it on.
+#define NUTPUNCH_ACK_DELAY (20 * NUTPUNCH_MS)
+
+/// Acknowledgement state of one peer. What we received is described by `recv_ack`, the last
+/// sequence number received with everything before it, plus a 64-bit mask where bit `i` stands for
+/// `recv_ack + 1 + i`. The pair gets tacked onto every DATA packet, and goes out as a standalone
+/// ACKY only when there's no DATA to ride on.
+///
+/// `send_una` goes along with them so the other side can stop waiting for packets we gave up on.
+typedef struct {
+    uint32_t send_seq, send_una; // last sequence number sent, and the oldest one still in flight
+    NP_OutgoingPacket* inflight[NUTPUNCH_ACK_WINDOW]; // indexed by sequence number
+    uint32_t recv_ack;
+    uint64_t received[NUTPUNCH_ACK_WINDOW / 64]; // bits past `recv_ack`, by sequence number
+    NutPunch_Clock ack_owed; // when we started owing them an ack, zero if we don't
+    NutPunch_Clock srtt, rttvar; // measured from acks, zero until the first one comes in
+} NP_AckState;
+
+/// Bounds for the retransmission timeout. The lower one has to leave room for `NUTPUNCH_ACK_DELAY`.
+#define NUTPUNCH_MIN_RTO (50 * NUTPUNCH_MS)
+#define NUTPUNCH_MAX_RTO (2000 * NUTPUNCH_MS)
+
+/// How many reliable messages per peer an `NPCM_Ordered` channel can hold back while waiting for a
+/// lost one. Must be 64 at most. Senders never get further ahead of their oldest unacked packet
+/// than this, so the receiving end never has to turn anything away.
+#define NUTPUNCH_REORDER_WINDOW (64)
+
+/// A peer's reliable traffic on one channel. `send_seq` numbers what we send them; the rest only
+/// matters if the channel is `NPCM_Ordered` on our end. Bit `i` of `received` is set once
+/// `recv_next + i` has arrived and is waiting in `held`, or was skipped and left it empty.
+typedef struct {
+    uint16_t send_seq, recv_next;
+    uint64_t received;
+    uint8_t** held; // `NUTPUNCH_REORDER_WINDOW` copies by sequence number, allocated on demand
+} NP_ChannelState;
+
 typedef struct {
     NutPunch_Field* metadata;
-    NP_SockAddr address;
+    uint32_t metadata_hash, metadata_seen; // `metadata_seen` is the hash of ours they say they have
+    NP_SockAddr address, pub, same_nat; // `pub` and `same_nat` are as reported by the NutPuncher
     NutPunch_Clock last_beating;
     NP_Pinger pinger;
+    NP_AckState acks;
+    NP_ChannelState channels[NUTPUNCH_MAX_CHANNELS];
+    uint16_t next_message; // numbers the fragmented messages we send them
+    NP_PathMTU path;
 } NP_PeerInfo;
 
+/// What comes before the payload in a DATA packet: the id prefix, the header, the acks, the channel
+/// and its sequence number.
+#define NUTPUNCH_DATA_OVERHEAD (4 + (int)sizeof(NP_Header) + NUTPUNCH_ACKS_SIZE + 1 + 2)
+
+/// Size of the FRAG header following the channel stuff: message number, fragment index, fragment
+/// count and the size of all the fragments but the last one.
+#define NUTPUNCH_FRAG_HEADER (2 + 1 + 1 + 2)
+
+/// Pseudo-channel for FRAGs carrying a whole reliable packet that got too big for the path after it
+/// was built, so the other end can glue it back together and handle it as if it made it in one go.
+/// The pieces themselves are unreliable, since the packet inside gets resent until it's acked.
+#define NUTPUNCH_TUNNEL_CHANNEL (0xFF)
+
+/// How many fragmented messages from one peer can be glued back together at once.
+#define NUTPUNCH_REASSEMBLY_SLOTS (4)
+
+/// How many more are kept for `NUTPUNCH_TUNNEL_CHANNEL`, since what comes through there could be
+/// the rest of the messages hogging the others.
+#define NUTPUNCH_TUNNEL_SLOTS (2)
+
+/// How long an unreliable fragmented message waits for its missing fragments before it's dropped.
+/// Reliable ones wait for `NUTPUNCH_TIMEOUT_INTERVAL`, since theirs keep getting resent.
+#define NUTPUNCH_REASSEMBLY_TIMEOUT (500 * NUTPUNCH_MS)
+
+/// A fragmented message being glued back together. Fragment `i` goes to `buf + i * chunk`. The
+/// buffer only ever grows, and stays around for the next message once this one's done.
+typedef struct {
+    uint8_t* buf;
+    size_t size, len; // `len` is known once the last fragment arrives
+    NutPunch_Clock last_seen; // zero if the slot is free
+    uint16_t number, seq, chunk; // `seq` is the channel sequence number of reliable messages
+    uint8_t count, got;
+    NutPunch_Channel chan;
+    bool reliable;
+    uint64_t have[4]; // bits by fragment index
+} NP_Reassembly;
+
 typedef struct {
     NP_SockAddr from;
     const uint8_t* data;
     size_t len;
+    uint32_t id;
 } NP_Message;
 
-typedef struct NP_IncomingData {
+/// Initial size of a channel's receiving queue in bytes. It doubles whenever a burst doesn't fit.
+#define NUTPUNCH_CHANNEL_BUFFER (16 * 1024)
+
+/// Header of a received packet, followed by its payload in an `NP_Ring`.
+typedef struct {
+    uint16_t len;
     NutPunch_Peer peer;
-    void* data;
-    size_t len;
-    struct NP_IncomingData* next;
+    uint8_t padding;
 } NP_IncomingData;
 
-typedef struct NP_OutgoingPacket {
-    NP_SockAddr destination;
-    uint8_t* data;
-    struct NP_OutgoingPacket* next;
-    int len, retries;
-    NutPunch_Clock last_retry;
-    bool acked;
-    uint32_t id;
-} NP_OutgoingPacket;
-
+/// A channel's receiving queue: `NP_IncomingData` records back to back. Records never straddle the
+/// end of the buffer; when one doesn't fit, writing wraps around to the start and `end` marks where
+/// the records before the wrap stop.
 typedef struct {
-    const char identifier[sizeof(NP_Header) + 1];
-    void (*const handle)(NP_Message);
-    const int64_t min_packet_size;
-} NP_MessageType;
+    uint8_t* buf;
+    size_t size, read, write, end, count;
+    bool wrapped;
+} NP_Ring;
+
+/// How many outgoing packet slots to allocate at once when there are no free ones left.
+#define NUTPUNCH_PENDING_SLAB (16)
+
+/// A chunk of outgoing packet slots. Slabs are never freed, only recycled through
+/// `NP_FreePackets`, so a warmed up client doesn't touch the heap to send anything.
+typedef struct NP_OutgoingSlab {
+    struct NP_OutgoingSlab* next;
+    NP_OutgoingPacket packets[NUTPUNCH_PENDING_SLAB];
+} NP_OutgoingSlab;
 
 static void NP_HandlePing(NP_Message), NP_HandlePong(NP_Message), NP_HandlePeer(NP_Message),
     NP_HandleGTFO(NP_Message), NP_HandleBeating(NP_Message), NP_HandleListing(NP_Message),
     NP_HandleLobbyData(NP_Message), NP_HandleData(NP_Message), NP_HandleQueue(NP_Message),
-    NP_HandleDate(NP_Message), NP_HandleAcky(NP_Message);
-
-static const NP_MessageType NP_MessageTypes[] = {
-    {"PING", NP_HandlePing,      1                         },
-    {"PONG", NP_HandlePong,      1                         },
-    {"ACKY", NP_HandleAcky,      4                         },
-    {"PEER", NP_HandlePeer,      1                         },
-    {"LIST", NP_HandleListing,   0                         },
-    {"LGMA", NP_HandleLobbyData, sizeof(NutPunch_LobbyName)},
-    {"DATA", NP_HandleData,      1                         },
-    {"GTFO", NP_HandleGTFO,      1                         },
-    {"BEAT", NP_HandleBeating,   sizeof(NP_Beating)        },
-    {"QUEU", NP_HandleQueue,     1                         },
-    {"DATE", NP_HandleDate,      sizeof(NutPunch_LobbyName)},
-};
+    NP_HandleDate(NP_Message), NP_HandleAcky(NP_Message), NP_HandleFrag(NP_Message),
+    NP_HandleProbe(NP_Message), NP_HandleProbeAck(NP_Message), NP_HandleSkip(NP_Message);
+static void NP_HandlePacket(NP_SockAddr from, const uint8_t* buf, int size);
+static void NP_QueueData(
+    NutPunch_Channel channel, NutPunch_Peer peer, const void* data, int size, bool reliable);
+static void NP_SendSkip(NutPunch_Peer peer, const uint8_t* channel);
+
+/// Reads a packet header as an `NP_Opcode`. Goes byte by byte so it doesn't care about
+/// endianness or alignment.
+static uint32_t NP_ReadOpcode(const void* header) {
+    const uint8_t* const bytes = (const uint8_t*)header;
+    return NP_Opcode(bytes[0], bytes[1], bytes[2], bytes[3]);
+}
 
 char NP_LastError[512] = "";
 
@@ -707,13 +920,19 @@ static bool NP_InitDone = false, NP_Closing = false;
 static NutPunch_UpdateStatus NP_LastStatus = NPS_Idle;
 
 static NP_Sock NP_Socket = NUTPUNCH_INVALID_SOCKET;
-static NutPunch_Clock NP_LastBeating = 0;
+static NutPunch_Clock NP_LastBeating = 0, NP_LastNudge = 0;
+static NutPunch_Clock NP_LastHeartbeat = 0; // zero to send one on the next update
+static NutPunch_Clock NP_HeartbeatInterval = NUTPUNCH_HEARTBEAT_INTERVAL * NUTPUNCH_MS;
+static uint32_t NP_LobbyEpoch = 0, NP_LobbyDataHash = 0; // as of the last BEAT
 
 static char NP_LobbyName[sizeof(NutPunch_LobbyName) + 1] = "";
 static char NP_PeerId[sizeof(NutPunch_PeerId) + 1] = "";
 static char NP_GameId[sizeof(NutPunch_GameId) + 1] = "";
 
 static NP_PeerInfo NP_Peers[NUTPUNCH_MAX_PLAYERS] = {0};
+static NP_Reassembly
+    NP_Reassemblies[NUTPUNCH_MAX_PLAYERS][NUTPUNCH_REASSEMBLY_SLOTS + NUTPUNCH_TUNNEL_SLOTS]
+    = {0};
 static NutPunch_Peer NP_LocalPeer = NUTPUNCH_MAX_PLAYERS, NP_Master = NUTPUNCH_MAX_PLAYERS,
                      NP_MaxPlayers = 0;
 
@@ -723,8 +942,10 @@ static NP_SockAddr NP_ServerAddr = {0};
 static char NP_ServerHost[128] = {0};
 
 static NutPunch_Channel NP_ChannelCount = 1;
-static NP_IncomingData* NP_Unread[NUTPUNCH_MAX_CHANNELS] = {0};
-static NP_OutgoingPacket* NP_Pending = NULL;
+static NP_Ring NP_Unread[NUTPUNCH_MAX_CHANNELS] = {0};
+static uint8_t NP_ChannelModes[NUTPUNCH_MAX_CHANNELS] = {0};
+static NP_OutgoingPacket *NP_Pending = NULL, *NP_PendingTail = NULL, *NP_FreePackets = NULL;
+static NP_OutgoingSlab* NP_OutgoingSlabs = NULL;
 
 static bool NP_Unlisted = false;
 
@@ -769,35 +990,116 @@ static NutPunch_Peer NP_FindPeer(NP_SockAddr addr) {
     return NUTPUNCH_MAX_PLAYERS;
 }
 
-static void NP_JustSend(NP_SockAddr destination, const void* data, size_t len, bool reliable) {
-    const int prefix = 4;
+static NP_OutgoingPacket* NP_AllocPacket() {
+    if (!NP_FreePackets) {
+        NP_OutgoingSlab* slab = (NP_OutgoingSlab*)NutPunch_Malloc(sizeof(*slab));
+        slab->next = NP_OutgoingSlabs, NP_OutgoingSlabs = slab;
 
-    if (prefix + len > NUTPUNCH_FRAGMENT_SIZE) {
-        NP_Warn("Ignoring a huge packet");
+        for (size_t i = 0; i < NP_Entries(slab->packets); i++)
+            slab->packets[i].next = NP_FreePackets, NP_FreePackets = &slab->packets[i];
+    }
+
+    NP_OutgoingPacket* packet = NP_FreePackets;
+    NP_FreePackets = packet->next;
+    return packet;
+}
+
+static void NP_FreePacket(NP_OutgoingPacket* packet) {
+    packet->next = NP_FreePackets, NP_FreePackets = packet;
+}
+
+static size_t NP_RecordSize(size_t len) {
+    return sizeof(NP_IncomingData) + ((len + 3) & ~(size_t)3);
+}
+
+static NP_IncomingData* NP_RingPeek(const NP_Ring* ring) {
+    return ring->count ? (NP_IncomingData*)(ring->buf + ring->read) : NULL;
+}
+
+static void NP_RingPop(NP_Ring* ring) {
+    if (!ring->count)
         return;
+
+    ring->read += NP_RecordSize(NP_RingPeek(ring)->len), ring->count--;
+    if (ring->wrapped && ring->read >= ring->end)
+        ring->read = 0, ring->wrapped = false;
+}
+
+/// Claims `need` contiguous bytes at the end of the queue, or returns `NULL` if they don't fit.
+static uint8_t* NP_RingReserve(NP_Ring* ring, size_t need) {
+    if (!ring->count)
+        ring->read = ring->write = ring->end = 0, ring->wrapped = false;
+
+    if (ring->wrapped) {
+        if (ring->write + need >= ring->read)
+            return NULL;
+    } else if (ring->write + need > ring->size) {
+        if (need >= ring->read)
+            return NULL;
+        ring->end = ring->write, ring->write = 0, ring->wrapped = true;
+    }
+
+    uint8_t* const at = ring->buf + ring->write;
+    ring->write += need, ring->count++;
+    return at;
+}
+
+/// Reallocates the queue to fit at least `need` more bytes, lining the records up from the start.
+static void NP_RingGrow(NP_Ring* ring, size_t need) {
+    size_t size = ring->size ? 2 * ring->size : NUTPUNCH_CHANNEL_BUFFER;
+    while (size < ring->size + need)
+        size *= 2;
+
+    uint8_t* const buf = (uint8_t*)NutPunch_Malloc(size);
+    size_t used = 0, count = ring->count;
+
+    for (const NP_IncomingData* data; (data = NP_RingPeek(ring)); NP_RingPop(ring)) {
+        NutPunch_MemCpy(buf + used, data, NP_RecordSize(data->len));
+        used += NP_RecordSize(data->len);
     }
 
-    static uint32_t counter = 0;
+    if (ring->buf)
+        NutPunch_Free(ring->buf);
 
-    NP_OutgoingPacket* last = NP_Pending;
-    for (; last && last->next; last = last->next) {}
+    ring->buf = buf, ring->size = size;
+    ring->read = 0, ring->write = ring->end = used, ring->count = count;
+    ring->wrapped = false;
+}
+
+/// Queues a packet with room for an id prefix, which stays zero unless it's a reliable one. Those
+/// get numbered once they're first sent. Returns NULL if the packet is too huge to send.
+static NP_OutgoingPacket* NP_Enqueue(NP_SockAddr destination, bool reliable, size_t len) {
+    const int prefix = 4;
+
+    if (prefix + len > NUTPUNCH_MAX_DATAGRAM_SIZE) {
+        NP_Warn("Ignoring a huge packet");
+        return NULL;
+    }
+
+    NP_OutgoingPacket* last = NP_AllocPacket();
+    *(NP_PendingTail ? &NP_PendingTail->next : &NP_Pending) = last;
+    NP_PendingTail = last;
 
-    last = *(last ? &last->next : &NP_Pending) = (NP_OutgoingPacket*)NutPunch_Malloc(sizeof(*last));
     last->destination = destination, last->next = NULL;
     last->retries = reliable ? 0 : -1, last->last_retry = 0, last->acked = false;
 
-    last->id = reliable ? ++counter : 0;
+    last->peer = NUTPUNCH_MAX_PLAYERS, last->id = 0;
     last->len = prefix + (int)len;
 
     // prefixing the entire packet with an id...
-    last->data = (uint8_t*)NutPunch_Malloc(last->len);
-    *(uint32_t*)last->data = htonl(last->id);
-    NutPunch_MemCpy(last->data + prefix, data, len);
+    *(uint32_t*)last->data = 0;
+    return last;
+}
+
+static void NP_JustSend(NP_SockAddr destination, const void* data, size_t len) {
+    NP_OutgoingPacket* packet = NP_Enqueue(destination, false, len);
+    if (packet)
+        NutPunch_MemCpy(packet->data + 4, data, len);
 }
 
 static void NP_JustSpam(NP_SockAddr destination, const void* data, size_t len) {
     for (int times = 5; times > 0; times--)
-        NP_JustSend(destination, data, len, false);
+        NP_JustSend(destination, data, len);
 }
 
 void NP_NukeSocket(NP_Sock* sock) {
@@ -820,10 +1122,29 @@ static void NP_NukeMetadata(NutPunch_Field** metadata) {
     }
 }
 
+static void NP_NukeHeld(NP_ChannelState* state) {
+    if (!state->held)
+        return;
+
+    for (int i = 0; i < NUTPUNCH_REORDER_WINDOW; i++)
+        if (state->held[i])
+            NutPunch_Free(state->held[i]);
+
+    NutPunch_Free(state->held);
+    state->held = NULL;
+}
+
 static void NP_NukePeer(NutPunch_Peer peer) {
     NP_PeerInfo* ptr = &NP_Peers[peer];
     NP_NukeMetadata(&ptr->metadata);
+
+    for (int i = 0; i < NUTPUNCH_MAX_CHANNELS; i++)
+        NP_NukeHeld(&ptr->channels[i]);
     NP_MemzeroRef(*ptr);
+
+    // keep the buffers, they're likely to come in handy for whoever takes this spot next
+    for (int i = 0; i < NUTPUNCH_REASSEMBLY_SLOTS + NUTPUNCH_TUNNEL_SLOTS; i++)
+        NP_Reassemblies[peer][i].last_seen = 0;
 }
 
 static void NP_NukeLobbyDataLite() {
@@ -832,6 +1153,9 @@ static void NP_NukeLobbyDataLite() {
 
     NP_Mode = NPNM_Normal;
     NP_HeartbeatFlags = NP_QueueTime = 0;
+    NP_LobbyEpoch = NP_LobbyDataHash = 0;
+    NP_LastHeartbeat = 0;
+    NP_MemzeroRef(NP_ServerPinger);
     NP_LobbyName[0] = 0;
 
     for (NutPunch_Peer i = 0; i < NUTPUNCH_MAX_PLAYERS; i++)
@@ -839,19 +1163,15 @@ static void NP_NukeLobbyDataLite() {
 
     NutPunch_SetMaxPlayers(NUTPUNCH_MAX_PLAYERS);
 
-    for (size_t i = 0; i < NUTPUNCH_MAX_CHANNELS; i++) {
-        while (NP_Unread[i]) {
-            NP_IncomingData* ptr = NP_Unread[i];
-            NP_Unread[i] = ptr->next;
-            NutPunch_Free(ptr->data), NutPunch_Free(ptr);
-        }
-    }
+    for (size_t i = 0; i < NUTPUNCH_MAX_CHANNELS; i++)
+        NP_Unread[i].count = 0;
 
     while (NP_Pending) {
         NP_OutgoingPacket* ptr = NP_Pending;
         NP_Pending = ptr->next;
-        NutPunch_Free(ptr->data), NutPunch_Free(ptr);
+        NP_FreePacket(ptr);
     }
+    NP_PendingTail = NULL;
 
     NP_NukeSocket(&NP_Socket);
 }
@@ -962,11 +1282,35 @@ static bool NP_SetVar(NutPunch_Field** fields, const char* name, const char* dat
 
         NutPunch_SNPrintF(target->name, sizeof(target->name), "%s", name);
         target->next = *fields, *fields = target;
+        changed = true;
     }
 
+    changed |= 0 != NutPunch_StrNCmp(target->data, data, sizeof(target->data) - 1);
     NutPunch_SNPrintF(target->data, sizeof(target->data), "%s", data);
 
-    return true;
+    return changed;
+}
+
+/// Hashes a metadata field with FNV-1a. A set of fields hashes to the sum of its fields' hashes, so
+/// the NutPuncher and the peers can compare metadata without agreeing on the order of fields.
+static uint32_t NP_HashField(const char* name, const char* data) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < sizeof(NutPunch_FieldName) - 1 && name[i]; i++)
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    hash *= 16777619u; // the null terminator, so "ab"="c" and "a"="bc" come out different
+
+    for (size_t i = 0; i < sizeof(NutPunch_FieldValue) - 1 && data[i]; i++)
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+
+    return hash;
+}
+
+static uint32_t NP_HashMetadata(const NutPunch_Field* fields) {
+    uint32_t hash = 0;
+    for (; fields; fields = fields->next)
+        hash += NP_HashField(fields->name, fields->data);
+    return hash;
 }
 
 static char* NP_DumpMetadata(char* out, const NutPunch_Field* fields) {
@@ -991,7 +1335,7 @@ void NutPunch_RequestLobbyData(const char* lobby) {
     ptr = NP_Write(ptr, NP_GameId, sizeof(NutPunch_GameId));
     ptr = NP_Print(ptr, lobby, sizeof(NutPunch_LobbyName));
 
-    NP_JustSend(NP_ServerAddr, buf, sizeof(buf), false);
+    NP_JustSend(NP_ServerAddr, buf, sizeof(buf));
 }
 
 const char* NutPunch_GetLobbyData(const char* name) {
@@ -1003,7 +1347,8 @@ const char* NutPunch_GetPeerData(NutPunch_Peer peer, const char* name) {
 }
 
 void NutPunch_SetLobbyData(const char* name, const char* data) {
-    NP_SetVar(&NP_LobbyMetadata, name, data);
+    if (NP_SetVar(&NP_LobbyMetadata, name, data))
+        NP_LastHeartbeat = 0;
 }
 
 void NutPunch_SetPeerData(const char* name, const char* data) {
@@ -1065,6 +1410,24 @@ bool NP_MakeReuseAddr(NP_Sock sock) {
     return !setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, shit, sizeof(argp));
 }
 
+/// Sets or clears the don't-fragment bit on whatever we send next. Path MTU probes need it set, or
+/// they'd make it through as IP fragments no matter how big they are. Everything else goes without
+/// it, so the IP layer can still save packets that turn out too big for a path that got narrower.
+static void NP_DontFragment(bool on) {
+#if defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+    const int value = on ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+    setsockopt(NP_Socket, IPPROTO_IP, IP_MTU_DISCOVER, (const char*)&value, sizeof(value));
+#elif defined(IP_DONTFRAGMENT)
+    const DWORD value = on;
+    setsockopt(NP_Socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*)&value, sizeof(value));
+#elif defined(IP_DONTFRAG)
+    const int value = on;
+    setsockopt(NP_Socket, IPPROTO_IP, IP_DONTFRAG, (const char*)&value, sizeof(value));
+#else
+    (void)on; // no way to set it, so the probes will overshoot on paths that fragment
+#endif
+}
+
 static bool NP_BindSocket() {
     NP_SockAddr local = {0};
     NP_LazyInit(), NP_NukeSocket(&NP_Socket);
@@ -1088,6 +1451,8 @@ static bool NP_BindSocket() {
         goto sockfail;
     }
 
+    NP_DontFragment(false); // some systems set it by default
+
     local.sin_family = AF_INET;
     local.sin_port = htons(0);
     local.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -1167,16 +1532,53 @@ bool NutPunch_EnterQueue() {
     return true;
 }
 
-int NutPunch_ServerPing() {
+static const NP_Pinger* NP_ServerPingerOrNull() {
     if (!NutPunch_IsOnline() || NP_Mode == NPNM_Query)
-        return 0;
-    return NP_ServerPinger.last_ping;
+        return NULL;
+    return &NP_ServerPinger;
 }
 
-int NutPunch_PeerPing(NutPunch_Peer idx) {
+static const NP_Pinger* NP_PeerPingerOrNull(NutPunch_Peer idx) {
     if (idx == NutPunch_LocalPeer() || !NutPunch_PeerAlive(idx))
-        return 0;
-    return NP_Peers[idx].pinger.last_ping;
+        return NULL;
+    return &NP_Peers[idx].pinger;
+}
+
+// halve the round-trip time as an approximation for how long it takes to send a packet one way
+static int NP_PingOf(const NP_Pinger* pinger) {
+    return pinger ? (int)(pinger->srtt / 2 / NUTPUNCH_MS) : 0;
+}
+
+static int NP_JitterOf(const NP_Pinger* pinger) {
+    return pinger ? (int)(pinger->rttvar / 2 / NUTPUNCH_MS) : 0;
+}
+
+static int NP_LossOf(const NP_Pinger* pinger) {
+    return pinger ? pinger->loss / 10 : 0;
+}
+
+int NutPunch_ServerPing() {
+    return NP_PingOf(NP_ServerPingerOrNull());
+}
+
+int NutPunch_PeerPing(NutPunch_Peer idx) {
+    return NP_PingOf(NP_PeerPingerOrNull(idx));
+}
+
+int NutPunch_ServerJitter() {
+    return NP_JitterOf(NP_ServerPingerOrNull());
+}
+
+int NutPunch_PeerJitter(NutPunch_Peer idx) {
+    return NP_JitterOf(NP_PeerPingerOrNull(idx));
+}
+
+int NutPunch_ServerLoss() {
+    return NP_LossOf(NP_ServerPingerOrNull());
+}
+
+int NutPunch_PeerLoss(NutPunch_Peer idx) {
+    return NP_LossOf(NP_PeerPingerOrNull(idx));
 }
 
 int NutPunch_QueueTime() {
@@ -1188,6 +1590,7 @@ void NutPunch_SetUnlisted(bool unlisted) {
         NP_HeartbeatFlags |= NP_HB_Unlisted;
     else
         NP_HeartbeatFlags &= ~NP_HB_Unlisted;
+    NP_LastHeartbeat = 0;
 }
 
 bool NutPunch_IsUnlisted() {
@@ -1202,6 +1605,7 @@ void NutPunch_SetMaxPlayers(int players) {
 
     NP_HeartbeatFlags &= 0xF;
     NP_HeartbeatFlags |= (players - 1) << 4;
+    NP_LastHeartbeat = 0;
 }
 
 int NutPunch_GetMaxPlayers() {
@@ -1230,7 +1634,7 @@ void NutPunch_FindLobbies(int filter_count, const NutPunch_Filter* filters) {
         ptr += filter_count * sizeof(NutPunch_Filter);
     }
 
-    NP_JustSend(NP_ServerAddr, query, ptr - query, false);
+    NP_JustSend(NP_ServerAddr, query, ptr - query);
 }
 
 const char* NutPunch_GetLastError() {
@@ -1278,36 +1682,36 @@ static void NP_LoadMetadata(const void* raw_in, size_t len, NutPunch_Field** fie
     }
 }
 
-static void NP_SendPings(NP_Pinger* pinger, NP_SockAddr address) {
+/// Feeds a round-trip time measurement into SRTT/RTTVAR as per RFC 6298.
+static void NP_SampleRTT(NutPunch_Clock* srtt, NutPunch_Clock* rttvar, NutPunch_Clock rtt) {
+    if (!*srtt) {
+        *srtt = rtt, *rttvar = rtt / 2;
+    } else {
+        const NutPunch_Clock delta = rtt > *srtt ? rtt - *srtt : *srtt - rtt;
+        *rttvar = (3 * *rttvar + delta) / 4;
+        *srtt = (7 * *srtt + rtt) / 8;
+    }
+}
+
+static void NP_SendPing(NP_Pinger* pinger, NP_SockAddr address) {
     if (pinger->start && NutPunch_TimeNS() - pinger->start < NUTPUNCH_PING_INTERVAL)
         return;
 
-    NutPunch_Clock sum = 0;
-
-    for (size_t i = 0; i < NP_Entries(pinger->measurements); i++) {
-        // halve the round-trip time as an approximation for how long it took to send the packet in
-        // one direction
-        sum += (pinger->measurements[i] - pinger->start) / 2;
-    }
+    // the previous probe never came back, so count it as lost
+    if (pinger->start && !pinger->answered)
+        pinger->loss += (1000 - pinger->loss) / 8;
 
-    pinger->last_ping = (int)((sum / NP_Entries(pinger->measurements)) / NUTPUNCH_MS);
-    pinger->start = NutPunch_TimeNS();
+    pinger->start = NutPunch_TimeNS(), pinger->answered = false;
 
     uint8_t buf[sizeof(NP_Header) + 1] = "PING";
-
-    for (uint8_t i = 0; (size_t)i < NP_Entries(pinger->measurements); i++) {
-        // by default, assume the pong never arrived within the pinging interval window
-        pinger->measurements[i] = pinger->start + NUTPUNCH_PING_INTERVAL;
-
-        buf[sizeof(NP_Header)] = i;
-        NP_JustSend(address, buf, sizeof(buf), false);
-    }
+    buf[sizeof(NP_Header)] = ++pinger->seq;
+    NP_JustSend(address, buf, sizeof(buf));
 }
 
 static void NP_HandlePing(NP_Message msg) {
     uint8_t buf[sizeof(NP_Header) + 1] = "PONG";
     buf[sizeof(NP_Header)] = *msg.data++;
-    NP_JustSend(msg.from, buf, sizeof(buf), false);
+    NP_JustSend(msg.from, buf, sizeof(buf));
 }
 
 static void NP_HandlePong(NP_Message msg) {
@@ -1318,19 +1722,111 @@ static void NP_HandlePong(NP_Message msg) {
     else if (NP_FindPeer(msg.from) != NUTPUNCH_MAX_PLAYERS)
         pinger = &NP_Peers[NP_FindPeer(msg.from)].pinger;
 
-    if (!pinger)
+    if (!pinger || pinger->answered || *msg.data != pinger->seq)
+        return; // a duplicate, or late enough to count as lost already
+
+    pinger->answered = true;
+    pinger->loss -= pinger->loss / 8;
+    NP_SampleRTT(&pinger->srtt, &pinger->rttvar, NutPunch_TimeNS() - pinger->start);
+}
+
+/// Sends a path MTU probe padded to `size` bytes. Returns `false` if it couldn't even leave.
+static bool NP_SendProbe(NP_SockAddr address, uint16_t size) {
+    static uint8_t buf[NUTPUNCH_MAX_DATAGRAM_SIZE] = {0};
+    NutPunch_MemCpy(buf + 4, "PMTU", sizeof(NP_Header));
+    *(uint16_t*)(buf + 4 + sizeof(NP_Header)) = htons(size);
+
+    // skipping the queue, since only this one needs the don't-fragment bit
+    NP_DontFragment(true);
+    struct sockaddr* const dest = (struct sockaddr*)&address;
+    const int sent = (int)sendto(NP_Socket, (char*)buf, size, 0, dest, sizeof(address));
+    NP_DontFragment(false);
+
+    return sent == size;
+}
+
+/// Moves path MTU discovery for `peer` along: retries or gives up on the current probe once it's
+/// overdue, then picks the next size to try. Goes for the maximum first, since most paths are
+/// plain old Ethernet, then does a binary search.
+static void NP_ProbePath(NutPunch_Peer peer) {
+    NP_PathMTU* const path = &NP_Peers[peer].path;
+    const NutPunch_Clock now = NutPunch_TimeNS();
+
+    if (!path->mtu) // just punched through
+        path->mtu = NUTPUNCH_FRAGMENT_SIZE, path->high = NUTPUNCH_MAX_DATAGRAM_SIZE + 1;
+
+    if (now < path->next)
+        return;
+
+    if (path->probe && path->tries >= NUTPUNCH_PMTU_MAX_PROBES)
+        path->high = path->probe, path->probe = 0;
+
+    if (!path->probe) {
+        if (path->high - path->mtu <= NUTPUNCH_PMTU_PRECISION) {
+            // close enough, but the path might get wider later
+            path->high = NUTPUNCH_MAX_DATAGRAM_SIZE + 1;
+            path->next = now + NUTPUNCH_PMTU_RAISE_INTERVAL;
+            return;
+        }
+
+        path->tries = 0;
+        if (path->high > NUTPUNCH_MAX_DATAGRAM_SIZE)
+            path->probe = NUTPUNCH_MAX_DATAGRAM_SIZE;
+        else
+            path->probe = (path->mtu + path->high) / 2;
+    }
+
+    path->tries++, path->next = now + NUTPUNCH_PMTU_PROBE_INTERVAL;
+    if (!NP_SendProbe(NP_Peers[peer].address, path->probe))
+        path->tries = NUTPUNCH_PMTU_MAX_PROBES, path->next = now; // too fat for our own interface
+}
+
+/// Called when a reliable packet of `size` bytes to `peer` keeps going unacked. If it's bigger than
+/// the base size, the path may have gotten narrower, so fall back and search again from there.
+static void NP_PathShrunk(NutPunch_Peer peer, int size) {
+    NP_PathMTU* const path = &NP_Peers[peer].path;
+    if (size <= NUTPUNCH_FRAGMENT_SIZE || size > path->mtu)
         return;
 
-    const uint8_t measurement = *msg.data++;
-    if (measurement < NP_Entries(pinger->measurements))
-        pinger->measurements[measurement] = NutPunch_TimeNS();
+    NP_Warn("Packets of %d bytes aren't getting through to peer %d anymore", size, peer);
+    path->mtu = NUTPUNCH_FRAGMENT_SIZE, path->high = (uint16_t)size;
+    path->probe = 0, path->next = 0;
+}
+
+static void NP_HandleProbe(NP_Message msg) {
+    const uint16_t size = ntohs(*(uint16_t*)msg.data);
+
+    // only answer if all of it made it here
+    if (NP_FindPeer(msg.from) == NUTPUNCH_MAX_PLAYERS || 4 + sizeof(NP_Header) + msg.len != size)
+        return;
+
+    uint8_t buf[sizeof(NP_Header) + 2] = "PMTA";
+    *(uint16_t*)(buf + sizeof(NP_Header)) = htons(size);
+    NP_JustSend(msg.from, buf, sizeof(buf));
+}
+
+static void NP_HandleProbeAck(NP_Message msg) {
+    const NutPunch_Peer peer = NP_FindPeer(msg.from);
+    const uint16_t size = ntohs(*(uint16_t*)msg.data);
+
+    if (peer == NUTPUNCH_MAX_PLAYERS)
+        return;
+
+    // only trust acks for the probe we've got going, which is always above the base size
+    NP_PathMTU* const path = &NP_Peers[peer].path;
+    if (!path->probe || size != path->probe || size <= NUTPUNCH_FRAGMENT_SIZE || size <= path->mtu)
+        return;
+
+    // on to the next size right away
+    path->mtu = size, path->probe = 0, path->next = 0;
 }
 
 static void NP_HandlePeer(NP_Message msg) {
     const uint8_t* ptr = msg.data;
 
     const NutPunch_Peer idx = *ptr++;
-    msg.len--;
+    const uint32_t hash = ntohl(*(uint32_t*)ptr), seen = ntohl(*(uint32_t*)(ptr + 4));
+    ptr += 8, msg.len -= 9;
 
     if (idx >= NUTPUNCH_MAX_PLAYERS)
         return;
@@ -1339,6 +1835,14 @@ static void NP_HandlePeer(NP_Message msg) {
 
     NP_PeerInfo* const peer = &NP_Peers[idx];
     peer->address = msg.from, peer->last_beating = NutPunch_TimeNS();
+    peer->metadata_seen = seen;
+
+    // nothing new, or they left the fields out thinking we're up to date (we'll say we aren't)
+    if (hash == peer->metadata_hash || hash && !msg.len) {
+        if (was_dead)
+            NP_HandleEventCb(NPCB_PeerJoined, &idx);
+        return;
+    }
 
     NutPunch_Field* metadata = NULL;
     NP_LoadMetadata(ptr, msg.len, &metadata);
@@ -1363,7 +1867,7 @@ static void NP_HandlePeer(NP_Message msg) {
     }
 
     NP_NukeMetadata(&peer->metadata);
-    peer->metadata = metadata;
+    peer->metadata = metadata, peer->metadata_hash = hash;
 
     if (was_dead)
         NP_HandleEventCb(NPCB_PeerJoined, &idx);
@@ -1407,8 +1911,9 @@ static void NP_PrintOurAddress(const uint8_t* data) {
     NP_Info("Server thinks you are %s", NP_FormatSockAddr(addr));
 }
 
-static void NP_NudgePeer(int idx, const uint8_t* data) {
-    if (NP_Socket == NUTPUNCH_INVALID_SOCKET || idx == NP_LocalPeer)
+/// Remembers where the NutPuncher says a peer is, or kills them if it says they're gone.
+static void NP_RoutePeer(int idx, const uint8_t* data) {
+    if (idx == NP_LocalPeer)
         return;
 
     NP_SockAddr pub = {0}, same_nat = {0};
@@ -1428,17 +1933,41 @@ static void NP_NudgePeer(int idx, const uint8_t* data) {
         return;
     }
 
-    static uint8_t buf[sizeof(NP_Header) + 1 + sizeof(NP_Metadata)] = "PEER";
+    NP_Peers[idx].pub = pub, NP_Peers[idx].same_nat = same_nat;
+}
+
+/// Sends our PEER packet to everyone in the lobby, punching through to those we can't reach yet.
+static void NP_NudgePeers() {
+    NP_LastNudge = NutPunch_TimeNS();
+    if (NP_Socket == NUTPUNCH_INVALID_SOCKET)
+        return;
+
+    static uint8_t buf[sizeof(NP_Header) + 1 + 4 + 4 + sizeof(NP_Metadata)] = "PEER";
+    const uint32_t hash = NP_HashMetadata(NP_PeerMetadata);
 
     uint8_t* ptr = buf + sizeof(NP_Header);
     *ptr++ = NP_LocalPeer;
-    ptr = (uint8_t*)NP_DumpMetadata((char*)ptr, NP_PeerMetadata);
+    *(uint32_t*)ptr = htonl(hash), ptr += 4;
 
-    if (NutPunch_PeerAlive(idx)) {
-        NP_JustSend(NP_Peers[idx].address, buf, ptr - buf, false);
-    } else {
-        NP_JustSend(pub, buf, ptr - buf, false);
-        NP_JustSend(same_nat, buf, ptr - buf, false);
+    uint8_t *const seen = ptr, *const fields = ptr + 4;
+    const uint8_t* const end = (uint8_t*)NP_DumpMetadata((char*)fields, NP_PeerMetadata);
+
+    for (int idx = 0; idx < NUTPUNCH_MAX_PLAYERS; idx++) {
+        const NP_PeerInfo* peer = &NP_Peers[idx];
+
+        if (idx == NP_LocalPeer)
+            continue;
+
+        // let them know which of theirs we have, and only send ours until they've got it
+        *(uint32_t*)seen = htonl(peer->metadata_hash);
+        const size_t len = (peer->metadata_seen == hash ? fields : end) - buf;
+
+        if (NutPunch_PeerAlive(idx)) {
+            NP_JustSend(peer->address, buf, len);
+        } else if (!NP_AddrNull(peer->pub) || !NP_AddrNull(peer->same_nat)) {
+            NP_JustSend(peer->pub, buf, len);
+            NP_JustSend(peer->same_nat, buf, len);
+        }
     }
 }
 
@@ -1456,6 +1985,9 @@ static void NP_HandleBeating(NP_Message msg) {
     const size_t num_peers = *ptr++;
     NP_MaxPlayers = *ptr++;
 
+    const uint32_t epoch = ntohl(*(uint32_t*)ptr), metadata_hash = ntohl(*(uint32_t*)(ptr + 4));
+    ptr += 8;
+
     if (NP_LocalPeer >= NUTPUNCH_MAX_PLAYERS) {
         NP_LocalPeer = NUTPUNCH_MAX_PLAYERS;
         NP_Warn("NutPuncher sent us a junk response?!");
@@ -1493,11 +2025,20 @@ static void NP_HandleBeating(NP_Message msg) {
     msg.len -= expected_len;
 
     for (int i = 0; i < NUTPUNCH_MAX_PLAYERS; i++) {
-        NP_NudgePeer(i, addrs[i]);
+        NP_RoutePeer(i, addrs[i]);
         if (i == NP_LocalPeer && just_joined && addrs[i])
             NP_PrintOurAddress(addrs[i]);
     }
 
+    NP_NudgePeers();
+
+    NP_LobbyEpoch = epoch, NP_LobbyDataHash = metadata_hash;
+
+    if (NP_HashMetadata(NP_LobbyMetadata) == metadata_hash)
+        goto done_getting_beat; // nothing changed
+    if (new_master == NutPunch_LocalPeer())
+        goto done_getting_beat; // the NutPuncher hasn't caught up with our changes yet
+
     NP_LoadMetadata(ptr, msg.len, &metadata);
 
     for (NutPunch_Field* then = NP_LobbyMetadata; then; then = then->next) {
@@ -1554,6 +2095,218 @@ static void NP_HandleLobbyData(NP_Message msg) {
     NP_NukeMetadata(&info.metadata);
 }
 
+static bool NP_InFlight(NP_AckState* acks, uint32_t seq) {
+    NP_OutgoingPacket* const packet = acks->inflight[seq % NUTPUNCH_ACK_WINDOW];
+    return packet && packet->id == seq;
+}
+
+/// Skips `send_una` past whatever got acked or given up on.
+static void NP_AdvanceUna(NP_AckState* acks) {
+    while (acks->send_una != acks->send_seq + 1 && !NP_InFlight(acks, acks->send_una))
+        acks->send_una++;
+}
+
+/// Tacks our ack state for `peer` onto a packet at `out`, which pays off any ack we owed them, so
+/// only call it on one that's about to be sent. Returns the pointer past it.
+static uint8_t* NP_WriteAcks(NutPunch_Peer peer, uint8_t* out) {
+    NP_AckState* const acks = &NP_Peers[peer].acks;
+    NP_AdvanceUna(acks);
+
+    const uint32_t next = (acks->recv_ack + 1) % NUTPUNCH_ACK_WINDOW, shift = next % 64;
+    const uint64_t* const words = acks->received;
+    const size_t count = NUTPUNCH_ACK_WINDOW / 64;
+
+    uint64_t mask = words[next / 64] >> shift;
+    if (shift)
+        mask |= words[(next / 64 + 1) % count] << (64 - shift);
+
+    *(uint32_t*)out = htonl(acks->recv_ack), out += 4;
+    *(uint32_t*)out = htonl((uint32_t)(mask >> 32)), out += 4;
+    *(uint32_t*)out = htonl((uint32_t)mask), out += 4;
+    *(uint32_t*)out = htonl(acks->send_una), out += 4;
+
+    acks->ack_owed = 0;
+    return out;
+}
+
+static void NP_SendAcks(NutPunch_Peer peer) {
+    static uint8_t buf[sizeof(NP_Header) + NUTPUNCH_ACKS_SIZE] = "ACKY";
+    NP_WriteAcks(peer, buf + sizeof(NP_Header));
+    NP_JustSend(NP_Peers[peer].address, buf, sizeof(buf));
+}
+
+/// Marks packet `seq` as acked. If it never had to be resent, `sent` is bumped to when it went out,
+/// since only those give an honest round-trip time (Karn's algorithm).
+static void NP_MarkAcked(NP_AckState* acks, uint32_t seq, NutPunch_Clock* sent) {
+    if (!NP_InFlight(acks, seq))
+        return;
+
+    NP_OutgoingPacket** const slot = &acks->inflight[seq % NUTPUNCH_ACK_WINDOW];
+    NP_OutgoingPacket* const packet = *slot;
+    packet->acked = true, *slot = NULL;
+
+    if (!packet->retries && packet->last_retry > *sent)
+        *sent = packet->last_retry;
+}
+
+static bool NP_Received(NP_AckState* acks, uint32_t seq, bool clear) {
+    uint64_t* const word = &acks->received[seq % NUTPUNCH_ACK_WINDOW / 64];
+    const uint64_t bit = (uint64_t)1 << (seq % 64);
+
+    const bool result = *word & bit;
+    if (clear)
+        *word &= ~bit;
+    return result;
+}
+
+/// Moves `recv_ack` up to `ack`, then keeps going for as long as we've got the next packet too.
+static void NP_AdvanceAcks(NP_AckState* acks, uint32_t ack) {
+    if (ack - acks->recv_ack >= NUTPUNCH_ACK_WINDOW)
+        NP_MemzeroRef(acks->received);
+    else
+        while (acks->recv_ack != ack)
+            NP_Received(acks, ++acks->recv_ack, true);
+
+    acks->recv_ack = ack;
+    while (NP_Received(acks, acks->recv_ack + 1, true))
+        acks->recv_ack++;
+}
+
+/// Eats an ack state written by `NP_WriteAcks` on the other end.
+static void NP_ReadAcks(NutPunch_Peer peer, const uint8_t* data) {
+    NP_AckState* const acks = &NP_Peers[peer].acks;
+    const uint32_t ack = ntohl(*(uint32_t*)data), una = ntohl(*(uint32_t*)(data + 12));
+    const uint64_t mask
+        = (uint64_t)ntohl(*(uint32_t*)(data + 4)) << 32 | ntohl(*(uint32_t*)(data + 8));
+
+    // they gave up on some packets, so don't hold the ack back waiting for them
+    if ((int32_t)(una - 1 - acks->recv_ack) > 0)
+        NP_AdvanceAcks(acks, una - 1);
+
+    if ((int32_t)(ack - acks->send_seq) > 0)
+        return; // acking stuff we never sent? nah
+
+    NutPunch_Clock sent = 0;
+    for (; (int32_t)(ack - acks->send_una) >= 0; acks->send_una++)
+        NP_MarkAcked(acks, acks->send_una, &sent);
+
+    uint32_t seq = ack + 1;
+    for (uint64_t bits = mask; bits; bits >>= 1, seq++)
+        if (bits & 1)
+            NP_MarkAcked(acks, seq, &sent);
+
+    // one sample per ack, from the freshest packet it covers
+    if (sent)
+        NP_SampleRTT(&acks->srtt, &acks->rttvar, NutPunch_TimeNS() - sent);
+}
+
+/// How long to wait before resending a reliable packet, doubling with each resend. Round-trip times
+/// measured from acks go first, then the ones from PINGs, then `NUTPUNCH_RETRY_INTERVAL`.
+static NutPunch_Clock NP_RetryTimeout(const NP_OutgoingPacket* packet) {
+    const NP_PeerInfo* const peer = &NP_Peers[packet->peer];
+    NutPunch_Clock srtt = peer->acks.srtt, rttvar = peer->acks.rttvar;
+
+    if (!srtt)
+        srtt = peer->pinger.srtt, rttvar = peer->pinger.rttvar;
+
+    NutPunch_Clock rto = srtt ? srtt + 4 * rttvar : NUTPUNCH_RETRY_INTERVAL * NUTPUNCH_MS;
+    if (rto < NUTPUNCH_MIN_RTO)
+        rto = NUTPUNCH_MIN_RTO;
+
+    for (int i = 0; i < packet->retries && rto < NUTPUNCH_MAX_RTO; i++)
+        rto *= 2;
+    return rto < NUTPUNCH_MAX_RTO ? rto : NUTPUNCH_MAX_RTO;
+}
+
+/// Returns `true` if we haven't seen reliable packet `seq` yet and it's close enough to keep track
+/// of.
+static bool NP_Fresh(NP_AckState* acks, uint32_t seq) {
+    const int32_t dist = (int32_t)(seq - acks->recv_ack);
+    return dist > 0 && dist < NUTPUNCH_ACK_WINDOW && !NP_Received(acks, seq, false);
+}
+
+/// Notes that we got reliable packet `seq` from `peer`, so the next ack they get covers it.
+/// Returns `false` if we've seen it already or it's too far ahead to keep track of.
+static bool NP_RecordReceipt(NutPunch_Peer peer, uint32_t seq) {
+    NP_AckState* const acks = &NP_Peers[peer].acks;
+
+    // ack even the duplicates, since they mean our previous ack got lost
+    if (!acks->ack_owed)
+        acks->ack_owed = NutPunch_TimeNS();
+
+    if (!NP_Fresh(acks, seq))
+        return false; // the ones too far ahead get resent once we catch up
+
+    acks->received[seq % NUTPUNCH_ACK_WINDOW / 64] |= (uint64_t)1 << (seq % 64);
+    NP_AdvanceAcks(acks, acks->recv_ack);
+    return true;
+}
+
+static void NP_Deliver(NutPunch_Peer peer, NutPunch_Channel chan, const void* data, size_t len) {
+    NP_Ring* const ring = &NP_Unread[chan];
+    const size_t need = NP_RecordSize(len);
+
+    uint8_t* at = NP_RingReserve(ring, need);
+    if (!at)
+        NP_RingGrow(ring, need), at = NP_RingReserve(ring, need);
+
+    NP_IncomingData* const record = (NP_IncomingData*)at;
+    record->peer = peer, record->len = (uint16_t)len;
+    NutPunch_MemCpy(record + 1, data, len);
+}
+
+/// Delivers reliable message `seq` on ordered channel `chan` from `peer` along with the ones held
+/// back after it, or holds it back itself if something before it is missing. A NULL `data` means
+/// they gave up on sending it, so it only stops holding the rest back. Returns `false` if it's too
+/// far ahead to hold, in which case it must not be acked.
+static bool NP_AcceptOrdered(
+    NutPunch_Peer peer, NutPunch_Channel chan, uint16_t seq, const uint8_t* data, size_t len) {
+    NP_ChannelState* const state = &NP_Peers[peer].channels[chan];
+    const int dist = (int16_t)(seq - state->recv_next);
+
+    if (dist < 0 || (dist < 64 && (state->received >> dist & 1)))
+        return true; // a duplicate, probably because our ack got lost
+    if (dist >= NUTPUNCH_REORDER_WINDOW)
+        return false;
+
+    if (!state->held) {
+        const size_t size = NUTPUNCH_REORDER_WINDOW * sizeof(*state->held);
+        state->held = (uint8_t**)NutPunch_Malloc(size);
+        NutPunch_MemSet(state->held, 0, size);
+    }
+
+    if (dist) {
+        if (data) {
+            NP_IncomingData* const copy
+                = (NP_IncomingData*)NutPunch_Malloc(sizeof(NP_IncomingData) + len);
+            copy->peer = peer, copy->len = (uint16_t)len;
+            NutPunch_MemCpy(copy + 1, data, len);
+            state->held[seq % NUTPUNCH_REORDER_WINDOW] = (uint8_t*)copy;
+        }
+
+        state->received |= (uint64_t)1 << dist;
+        return true;
+    }
+
+    if (data)
+        NP_Deliver(peer, chan, data, len);
+    state->received >>= 1, state->recv_next++;
+
+    while (state->received & 1) {
+        uint8_t** const slot = &state->held[state->recv_next % NUTPUNCH_REORDER_WINDOW];
+        const NP_IncomingData* const copy = (const NP_IncomingData*)*slot;
+
+        if (copy) {
+            NP_Deliver(peer, chan, copy + 1, copy->len);
+            NutPunch_Free(*slot), *slot = NULL;
+        }
+
+        state->received >>= 1, state->recv_next++;
+    }
+
+    return true;
+}
+
 static void NP_HandleData(NP_Message msg) {
     NutPunch_Peer peer_idx = NP_FindPeer(msg.from);
     NP_Trace("DATA FROM %d", peer_idx);
@@ -1561,19 +2314,189 @@ static void NP_HandleData(NP_Message msg) {
     if (peer_idx == NUTPUNCH_MAX_PLAYERS)
         return;
 
+    NP_ReadAcks(peer_idx, msg.data);
+    msg.data += NUTPUNCH_ACKS_SIZE, msg.len -= NUTPUNCH_ACKS_SIZE;
+
     const NutPunch_Channel chan = (msg.len--, *msg.data++);
-    if (chan >= NP_ChannelCount)
+
+    if (!msg.id) {
+        if (chan < NP_ChannelCount)
+            NP_Deliver(peer_idx, chan, msg.data, msg.len);
+        return;
+    }
+
+    if (msg.len < 2)
+        return;
+
+    const uint16_t seq = ntohs(*(uint16_t*)msg.data);
+    msg.data += 2, msg.len -= 2;
+
+    // ack the ones on channels we don't listen to as well, so they aren't resent for nothing
+    if (chan >= NP_ChannelCount) {
+        NP_RecordReceipt(peer_idx, msg.id);
+    } else if (NP_ChannelModes[chan] != NPCM_Ordered) {
+        if (NP_RecordReceipt(peer_idx, msg.id))
+            NP_Deliver(peer_idx, chan, msg.data, msg.len);
+    } else if (NP_AcceptOrdered(peer_idx, chan, seq, msg.data, msg.len)) {
+        NP_RecordReceipt(peer_idx, msg.id);
+    }
+}
+
+/// They gave up on a reliable message, so an ordered channel had better stop waiting for it.
+static void NP_HandleSkip(NP_Message msg) {
+    const NutPunch_Peer peer = NP_FindPeer(msg.from);
+    if (peer == NUTPUNCH_MAX_PLAYERS || !msg.id)
+        return;
+
+    NP_ReadAcks(peer, msg.data);
+    msg.data += NUTPUNCH_ACKS_SIZE;
+
+    const NutPunch_Channel chan = *msg.data++;
+    const uint16_t seq = ntohs(*(uint16_t*)msg.data);
+
+    if (chan >= NP_ChannelCount || NP_ChannelModes[chan] != NPCM_Ordered
+        || NP_AcceptOrdered(peer, chan, seq, NULL, 0))
+    {
+        NP_RecordReceipt(peer, msg.id);
+    }
+}
+
+/// Finds the slot gluing together message `number` from `peer`, or claims one for it. Slots that
+/// haven't seen a fragment in too long are up for grabs. Returns NULL if they're all busy.
+static NP_Reassembly*
+NP_FindReassembly(NutPunch_Peer peer, uint16_t number, bool reliable, bool tunnel) {
+    const NutPunch_Clock now = NutPunch_TimeNS();
+    NP_Reassembly* claim = NULL;
+
+    const int first = tunnel ? NUTPUNCH_REASSEMBLY_SLOTS : 0;
+    const int end = NUTPUNCH_REASSEMBLY_SLOTS + (tunnel ? NUTPUNCH_TUNNEL_SLOTS : 0);
+
+    for (int i = first; i < end; i++) {
+        NP_Reassembly* const slot = &NP_Reassemblies[peer][i];
+        const NutPunch_Clock timeout = slot->reliable ? NUTPUNCH_TIMEOUT_INTERVAL * NUTPUNCH_MS
+                                                      : NUTPUNCH_REASSEMBLY_TIMEOUT;
+
+        if (!slot->last_seen || now - slot->last_seen >= timeout) {
+            if (!claim)
+                claim = slot;
+        } else if (slot->number == number && slot->reliable == reliable) {
+            return slot;
+        }
+    }
+
+    if (claim)
+        claim->last_seen = 0;
+    return claim;
+}
+
+/// Handles a packet that got glued back together off `NUTPUNCH_TUNNEL_CHANNEL` as if it had arrived
+/// whole. Only DATA and FRAG ever get tunneled, and never twice over.
+static void NP_HandleTunneled(NP_SockAddr from, const uint8_t* data, size_t len) {
+    static uint8_t buf[NUTPUNCH_MAX_DATAGRAM_SIZE] = {0};
+    const size_t chan_at = 4 + sizeof(NP_Header) + NUTPUNCH_ACKS_SIZE;
+
+    if (len > sizeof(buf) || len <= chan_at || data[chan_at] == NUTPUNCH_TUNNEL_CHANNEL)
+        return;
+
+    const uint32_t opcode = NP_ReadOpcode(data + 4);
+    if (opcode != NP_Opcode('D', 'A', 'T', 'A') && opcode != NP_Opcode('F', 'R', 'A', 'G'))
+        return;
+
+    // a FRAG inside might get glued together in the very slot this came out of
+    NutPunch_MemCpy(buf, data, len);
+    NP_HandlePacket(from, buf, (int)len);
+}
+
+static void NP_HandleFrag(NP_Message msg) {
+    const NutPunch_Peer peer = NP_FindPeer(msg.from);
+    NP_Trace("FRAG FROM %d", peer);
+
+    if (peer == NUTPUNCH_MAX_PLAYERS)
+        return;
+
+    NP_ReadAcks(peer, msg.data);
+    msg.data += NUTPUNCH_ACKS_SIZE, msg.len -= NUTPUNCH_ACKS_SIZE;
+
+    const NutPunch_Channel chan = (msg.len--, *msg.data++);
+    uint16_t seq = 0;
+
+    if (msg.id) {
+        if (msg.len < 2 + NUTPUNCH_FRAG_HEADER)
+            return;
+        seq = ntohs(*(uint16_t*)msg.data), msg.data += 2, msg.len -= 2;
+    }
+
+    const uint16_t number = ntohs(*(uint16_t*)msg.data), chunk = ntohs(*(uint16_t*)(msg.data + 4));
+    const uint8_t index = msg.data[2], count = msg.data[3];
+    msg.data += NUTPUNCH_FRAG_HEADER, msg.len -= NUTPUNCH_FRAG_HEADER;
+
+    if (!chunk || index >= count || msg.len > chunk || (index + 1 < count && msg.len != chunk)
+        || (size_t)(count - 1) * chunk >= NUTPUNCH_MAX_MESSAGE_SIZE
+        || (size_t)index * chunk + msg.len > NUTPUNCH_MAX_MESSAGE_SIZE)
+    {
+        return; // junk, or bigger than a record in `NP_Unread` can describe
+    }
+
+    const bool tunnel = chan == NUTPUNCH_TUNNEL_CHANNEL;
+    const bool listening = chan < NP_ChannelCount || tunnel;
+
+    // duplicates and the ones on channels we don't listen to only need acking
+    if (msg.id && (!listening || !NP_Fresh(&NP_Peers[peer].acks, msg.id))) {
+        NP_RecordReceipt(peer, msg.id);
+        return;
+    }
+
+    if (!listening)
         return;
 
-    NP_IncomingData* last = NP_Unread[chan];
-    for (; last && last->next; last = last->next) {}
+    // reliable fragments that don't fit anywhere stay unacked, so they get resent later
+    NP_Reassembly* const slot = NP_FindReassembly(peer, number, msg.id, tunnel);
+    if (!slot)
+        return;
+
+    if (!slot->last_seen) {
+        const size_t size = (size_t)count * chunk;
+        if (slot->size < size) {
+            if (slot->buf)
+                NutPunch_Free(slot->buf);
+            slot->buf = (uint8_t*)NutPunch_Malloc(size), slot->size = size;
+        }
+
+        slot->number = number, slot->seq = seq, slot->chunk = chunk;
+        slot->count = count, slot->got = 0, slot->len = 0;
+        slot->chan = chan, slot->reliable = msg.id;
+        NP_MemzeroRef(slot->have);
+    } else if (slot->count != count || slot->chunk != chunk || slot->chan != chan
+               || slot->seq != seq)
+    {
+        return;
+    }
 
-    last = *(last ? &last->next : &NP_Unread[chan])
-        = (NP_IncomingData*)NutPunch_Malloc(sizeof(*last));
+    if (msg.id)
+        NP_RecordReceipt(peer, msg.id);
+    slot->last_seen = NutPunch_TimeNS();
 
-    last->peer = peer_idx, last->len = msg.len, last->next = NULL;
-    last->data = NutPunch_Malloc(last->len);
-    NutPunch_MemCpy(last->data, msg.data, last->len);
+    uint64_t* const word = &slot->have[index / 64];
+    const uint64_t bit = (uint64_t)1 << (index % 64);
+
+    if (*word & bit)
+        return;
+
+    *word |= bit, slot->got++;
+    NutPunch_MemCpy(slot->buf + (size_t)index * chunk, msg.data, msg.len);
+    if (index + 1 == count)
+        slot->len = (size_t)index * chunk + msg.len;
+
+    if (slot->got < slot->count)
+        return;
+
+    slot->last_seen = 0;
+    if (tunnel)
+        NP_HandleTunneled(msg.from, slot->buf, slot->len);
+    else if (slot->reliable && NP_ChannelModes[chan] == NPCM_Ordered)
+        NP_AcceptOrdered(peer, chan, slot->seq, slot->buf, slot->len);
+    else
+        NP_Deliver(peer, chan, slot->buf, slot->len);
 }
 
 static void NP_HandleQueue(NP_Message msg) {
@@ -1592,19 +2515,29 @@ static void NP_HandleDate(NP_Message msg) {
 }
 
 static void NP_HandleAcky(NP_Message msg) {
-    for (NP_OutgoingPacket* cur = NP_Pending; cur; cur = cur->next)
-        cur->acked |= (cur->id == ntohl(*(uint32_t*)msg.data));
+    const NutPunch_Peer peer = NP_FindPeer(msg.from);
+    if (peer != NUTPUNCH_MAX_PLAYERS)
+        NP_ReadAcks(peer, msg.data);
 }
 
 static void NP_SendHeartbeat() {
     if (NP_Socket == NUTPUNCH_INVALID_SOCKET)
         return;
 
+    const NutPunch_Clock now = NutPunch_TimeNS();
+    if (NP_LastHeartbeat && now - NP_LastHeartbeat < NP_HeartbeatInterval)
+        return;
+    NP_LastHeartbeat = now;
+
     static char heartbeat[sizeof(NP_Header) + sizeof(NP_Heartbeat) + sizeof(NP_Metadata)] = {0};
     NP_Memzero(heartbeat);
 
     char* ptr = heartbeat;
 
+    // only the master's fields count, and only when the NutPuncher doesn't have them yet
+    const uint32_t hash = NP_HashMetadata(NP_LobbyMetadata);
+    const bool master = NP_LocalPeer == NUTPUNCH_MAX_PLAYERS || NP_LocalPeer == NP_Master;
+
     NP_SockAddr addr = {0};
     socklen_t addr_size = sizeof(addr);
     getsockname(NP_Socket, (struct sockaddr*)&addr, &addr_size);
@@ -1621,8 +2554,12 @@ static void NP_SendHeartbeat() {
 
         *(uint32_t*)ptr = addr.sin_addr.s_addr, ptr += 4;
         *(uint16_t*)ptr = addr.sin_port, ptr += 2;
+        *(uint32_t*)ptr = htonl(NP_LobbyEpoch), ptr += 4;
 
-        ptr = NP_DumpMetadata(ptr, NP_LobbyMetadata);
+        *(uint32_t*)ptr = htonl(hash), ptr += 4;
+
+        if (master && hash != NP_LobbyDataHash)
+            ptr = NP_DumpMetadata(ptr, NP_LobbyMetadata);
 
         break;
 
@@ -1637,8 +2574,8 @@ static void NP_SendHeartbeat() {
         return;
     }
 
-    NP_JustSend(NP_ServerAddr, heartbeat, ptr - heartbeat, false);
-    NP_SendPings(&NP_ServerPinger, NP_ServerAddr);
+    NP_JustSend(NP_ServerAddr, heartbeat, ptr - heartbeat);
+    NP_SendPing(&NP_ServerPinger, NP_ServerAddr);
 }
 
 static int NP_UglyRecvFrom(NP_SockAddr* addr, void* buf, int buf_size) {
@@ -1647,13 +2584,63 @@ static int NP_UglyRecvFrom(NP_SockAddr* addr, void* buf, int buf_size) {
     return recvfrom(NP_Socket, (char*)buf, buf_size, 0, shit_addr, &addr_size);
 }
 
-static void NP_ReceiveShit() {
+static void NP_HandlePacket(NP_SockAddr from, const uint8_t* buf, int size) {
     const int prefix = 4;
 
+    size -= prefix + (int)sizeof(NP_Header);
+
+    if (size < 0)
+        return; // junk
+
+    void (*handle)(NP_Message) = NULL;
+    int64_t min_size = 1;
+
+    switch (NP_ReadOpcode(buf + prefix)) {
+    case NP_Opcode('P', 'I', 'N', 'G'): handle = NP_HandlePing; break;
+    case NP_Opcode('P', 'O', 'N', 'G'): handle = NP_HandlePong; break;
+    case NP_Opcode('A', 'C', 'K', 'Y'):
+        handle = NP_HandleAcky, min_size = NUTPUNCH_ACKS_SIZE;
+        break;
+    case NP_Opcode('P', 'E', 'E', 'R'): handle = NP_HandlePeer, min_size = 1 + 4 + 4; break;
+    case NP_Opcode('L', 'I', 'S', 'T'): handle = NP_HandleListing, min_size = 0; break;
+    case NP_Opcode('L', 'G', 'M', 'A'):
+        handle = NP_HandleLobbyData, min_size = sizeof(NutPunch_LobbyName);
+        break;
+    case NP_Opcode('D', 'A', 'T', 'A'):
+        handle = NP_HandleData, min_size = NUTPUNCH_ACKS_SIZE + 1;
+        break;
+    case NP_Opcode('F', 'R', 'A', 'G'):
+        handle = NP_HandleFrag, min_size = NUTPUNCH_ACKS_SIZE + 1 + NUTPUNCH_FRAG_HEADER;
+        break;
+    case NP_Opcode('S', 'K', 'I', 'P'):
+        handle = NP_HandleSkip, min_size = NUTPUNCH_ACKS_SIZE + 1 + 2;
+        break;
+    case NP_Opcode('P', 'M', 'T', 'U'): handle = NP_HandleProbe, min_size = 2; break;
+    case NP_Opcode('P', 'M', 'T', 'A'): handle = NP_HandleProbeAck, min_size = 2; break;
+    case NP_Opcode('G', 'T', 'F', 'O'): handle = NP_HandleGTFO; break;
+    case NP_Opcode('B', 'E', 'A', 'T'):
+        handle = NP_HandleBeating, min_size = sizeof(NP_Beating);
+        break;
+    case NP_Opcode('Q', 'U', 'E', 'U'): handle = NP_HandleQueue; break;
+    case NP_Opcode('D', 'A', 'T', 'E'):
+        handle = NP_HandleDate, min_size = sizeof(NutPunch_LobbyName);
+        break;
+    default: break;
+    }
+
+    if (handle && size >= min_size) {
+        NP_Message msg = {0};
+        msg.from = from, msg.len = size, msg.id = ntohl(*(uint32_t*)buf);
+        msg.data = (uint8_t*)(buf + prefix + sizeof(NP_Header));
+        handle(msg);
+    }
+}
+
+static void NP_ReceiveShit() {
     for (;;) {
         NP_SockAddr addr = {0};
-        static uint8_t buf[NUTPUNCH_FRAGMENT_SIZE] = {0};
-        int size = NP_UglyRecvFrom(&addr, buf, sizeof(buf));
+        static uint8_t buf[NUTPUNCH_MAX_DATAGRAM_SIZE] = {0};
+        const int size = NP_UglyRecvFrom(&addr, buf, sizeof(buf));
 
         if (size < 0) {
             if (NP_SockError() == NP_WouldBlock) {
@@ -1668,33 +2655,7 @@ static void NP_ReceiveShit() {
             }
         }
 
-        size -= prefix + (int)sizeof(NP_Header);
-
-        if (size < 0)
-            continue; // junk
-
-        uint32_t id = ntohl(*(uint32_t*)buf);
-        if (id) { // ackies
-            static uint8_t acky[sizeof(NP_Header) + 4] = "ACKY";
-            *(uint32_t*)(acky + sizeof(NP_Header)) = htonl(id);
-            NP_JustSpam(addr, acky, sizeof(acky));
-        }
-
-        for (size_t i = 0; i < sizeof(NP_MessageTypes) / sizeof(*NP_MessageTypes); i++) {
-            const NP_MessageType type = NP_MessageTypes[i];
-
-            if (size < type.min_packet_size)
-                continue;
-            if (0 != NutPunch_MemCmp(buf + prefix, type.identifier, sizeof(NP_Header)))
-                continue;
-
-            NP_Message msg = {0};
-            msg.from = addr, msg.len = size;
-            msg.data = (uint8_t*)(buf + prefix + sizeof(NP_Header));
-            type.handle(msg);
-
-            break;
-        }
+        NP_HandlePacket(addr, buf, size);
 
         if (NP_LastStatus == NPS_Error)
             break;
@@ -1722,34 +2683,76 @@ void NutPunch_Flush() {
 
     const NutPunch_Clock now = NutPunch_TimeNS();
 
+    // nothing to piggyback these on for a while, so send them as is
+    for (NutPunch_Peer i = 0; i < NUTPUNCH_MAX_PLAYERS; i++) {
+        const NutPunch_Clock owed = NP_Peers[i].acks.ack_owed;
+        if (owed && now - owed >= NUTPUNCH_ACK_DELAY)
+            NP_SendAcks(i);
+    }
+
     for (NP_OutgoingPacket *prev = NULL, *cur = NP_Pending; cur;) {
         bool send = false, nuke = false;
 
         if (cur->retries < 0) {
             send = nuke = true;
         } else if (cur->last_retry) {
-            const bool due = now - cur->last_retry
-                             > (NUTPUNCH_RETRY_INTERVAL * (cur->retries + 1)) * NUTPUNCH_MS;
+            const bool due = now - cur->last_retry > NP_RetryTimeout(cur);
             nuke = cur->acked || due && cur->retries++ > NUTPUNCH_MAX_RETRIES;
             send = due && !nuke;
+
+            if (send && cur->retries == NUTPUNCH_PMTU_BLACKHOLE_RETRIES)
+                NP_PathShrunk(cur->peer, cur->len);
         } else {
-            send = true, nuke = false;
+            // don't get further ahead of the oldest unacked packet than the other end can hold
+            NP_AckState* const acks = &NP_Peers[cur->peer].acks;
+            NP_AdvanceUna(acks);
+
+            const uint32_t id = acks->send_seq + 1;
+            send = (int32_t)(id - acks->send_una) < NUTPUNCH_REORDER_WINDOW, nuke = false;
+
+            // numbering them only now keeps the ones in flight well within `NUTPUNCH_ACK_WINDOW`
+            if (send) {
+                acks->send_seq = cur->id = id, *(uint32_t*)cur->data = htonl(id);
+                acks->inflight[id % NUTPUNCH_ACK_WINDOW] = cur;
+            }
         }
 
         if (send) {
             cur->last_retry = now;
 
-            struct sockaddr* dest = (struct sockaddr*)&cur->destination;
-            sendto(NP_Socket, (char*)cur->data, cur->len, 0, dest, sizeof(cur->destination));
+            // only now do the acks actually go out, and they're fresher too
+            if (cur->peer != NUTPUNCH_MAX_PLAYERS)
+                NP_WriteAcks(cur->peer, cur->data + 4 + sizeof(NP_Header));
+
+            // built before the path shrunk under it, so it can only go in pieces now
+            const int mtu = NutPunch_PeerMTU(cur->peer);
+            if (cur->id && mtu && cur->len > mtu) {
+                NP_QueueData(NUTPUNCH_TUNNEL_CHANNEL, cur->peer, cur->data, cur->len, false);
+            } else {
+                struct sockaddr* dest = (struct sockaddr*)&cur->destination;
+                sendto(NP_Socket, (char*)cur->data, cur->len, 0, dest, sizeof(cur->destination));
+            }
         }
 
         if (nuke) {
+            if (cur->id && !cur->acked)
+                NP_SendSkip(cur->peer, cur->data + 4 + sizeof(NP_Header) + NUTPUNCH_ACKS_SIZE);
+
+            if (cur->id) {
+                NP_OutgoingPacket** const slot
+                    = &NP_Peers[cur->peer].acks.inflight[cur->id % NUTPUNCH_ACK_WINDOW];
+                if (*slot == cur)
+                    *slot = NULL;
+            }
+
             *(prev ? &prev->next : &NP_Pending) = cur->next;
+            if (cur == NP_PendingTail)
+                NP_PendingTail = prev;
 
             NP_OutgoingPacket* tmp = cur;
             cur = tmp->next;
 
-            NutPunch_Free(tmp->data), NutPunch_Free(tmp);
+            NP_FreePacket(tmp);
         } else {
             prev = cur;
             cur = cur->next;
@@ -1788,9 +2791,16 @@ NutPunch_UpdateStatus NutPunch_Update() {
         }
     }
 
-    for (NutPunch_Peer peer = 0; peer < NUTPUNCH_MAX_PLAYERS; peer++)
-        if (NutPunch_PeerAlive(peer) && peer != NutPunch_LocalPeer())
-            NP_SendPings(&NP_Peers[peer].pinger, NP_Peers[peer].address);
+    for (NutPunch_Peer peer = 0; peer < NUTPUNCH_MAX_PLAYERS; peer++) {
+        if (!NutPunch_PeerAlive(peer) || peer == NutPunch_LocalPeer())
+            continue;
+
+        NP_SendPing(&NP_Peers[peer].pinger, NP_Peers[peer].address);
+        NP_ProbePath(peer);
+    }
+
+    if (NutPunch_TimeNS() - NP_LastNudge >= NUTPUNCH_NUDGE_INTERVAL)
+        NP_NudgePeers();
 
     NP_LastStatus = NPS_Online;
     NP_TimeOutPeers();
@@ -1813,14 +2823,56 @@ void NutPunch_Disconnect() {
     NutPunch_Reset();
 }
 
+void NutPunch_SetChannelMode(NutPunch_Channel channel, NutPunch_ChannelMode mode) {
+    if (channel < NUTPUNCH_MAX_CHANNELS)
+        NP_ChannelModes[channel] = (uint8_t)mode;
+}
+
 void NutPunch_SetChannelCount(int count) {
     if (count < 1 || count > NUTPUNCH_MAX_CHANNELS)
         return;
     NP_ChannelCount = count;
+
+    for (int i = 0; i < NUTPUNCH_MAX_CHANNELS; i++) {
+        NP_Ring* const ring = &NP_Unread[i];
+
+        if (i < count && !ring->buf) {
+            NP_RingGrow(ring, 0);
+        } else if (i >= count && ring->buf) {
+            NutPunch_Free(ring->buf);
+            NP_MemzeroRef(*ring);
+        }
+    }
+}
+
+void NutPunch_SetHeartbeatInterval(int ms) {
+    const int max = (int)(NUTPUNCH_TIMEOUT_INTERVAL / 5);
+    ms = ms < 10 ? 10 : (ms > max ? max : ms);
+    NP_HeartbeatInterval = (NutPunch_Clock)ms * NUTPUNCH_MS;
 }
 
 bool NutPunch_HasMessage(NutPunch_Channel chan) {
-    return chan < NUTPUNCH_MAX_CHANNELS && NP_Unread[chan] != NULL;
+    return chan < NUTPUNCH_MAX_CHANNELS && NP_Unread[chan].count;
+}
+
+const void* NutPunch_PeekMessage(NutPunch_Channel chan, int* size, NutPunch_Peer* peer) {
+    const NP_IncomingData* const data
+        = chan < NUTPUNCH_MAX_CHANNELS ? NP_RingPeek(&NP_Unread[chan]) : NULL;
+
+    if (!data)
+        return NULL;
+
+    if (size)
+        *size = data->len;
+    if (peer)
+        *peer = data->peer;
+
+    return data + 1;
+}
+
+void NutPunch_ConsumeMessage(NutPunch_Channel chan) {
+    if (chan < NUTPUNCH_MAX_CHANNELS)
+        NP_RingPop(&NP_Unread[chan]);
 }
 
 int NutPunch_NextMessage(NutPunch_Channel chan, void* out, int* size) {
@@ -1829,30 +2881,98 @@ int NutPunch_NextMessage(NutPunch_Channel chan, void* out, int* size) {
         return NUTPUNCH_MAX_PLAYERS;
     }
 
-    NP_IncomingData* const packet = NP_Unread[chan];
+    int len = 0;
+    NutPunch_Peer peer = NUTPUNCH_MAX_PLAYERS;
+    const void* const data = NutPunch_PeekMessage(chan, &len, &peer);
 
-    if (!packet) {
+    if (!data) {
         NP_Warn("You forgot to check `NutPunch_HasMessage(%d)`", chan);
         return NUTPUNCH_MAX_PLAYERS;
     }
 
-    if (size && *size < packet->len) {
+    if (size && *size < len) {
         NP_Warn("Not enough memory allocated to copy the next packet");
         return NUTPUNCH_MAX_PLAYERS;
     }
 
     if (size)
-        *size = (int)packet->len;
+        *size = len;
     if (out)
-        NutPunch_MemCpy(out, packet->data, packet->len);
+        NutPunch_MemCpy(out, data, len);
 
-    NP_Unread[chan] = packet->next;
-    const NutPunch_Peer peer = packet->peer;
+    NutPunch_ConsumeMessage(chan);
+    return peer;
+}
 
-    NutPunch_Free(packet->data);
-    NutPunch_Free(packet);
+/// Queues a DATA or FRAG packet with room for `len` bytes after the channel stuff, and returns
+/// where they go. Reliable ones carry the channel sequence number `seq`.
+static uint8_t* NP_StartData(const char* type, NutPunch_Channel channel, NutPunch_Peer peer,
+    bool reliable, uint16_t seq, size_t len) {
+    const size_t total_size = sizeof(NP_Header) + NUTPUNCH_ACKS_SIZE + 1 + (reliable ? 2 : 0) + len;
+    NP_OutgoingPacket* const packet = NP_Enqueue(NP_Peers[peer].address, reliable, total_size);
+    if (!packet)
+        return NULL;
 
-    return peer;
+    packet->peer = peer;
+
+    // the acks are left for `NutPunch_Flush` to fill in, since this might sit in the queue a while
+    uint8_t* ptr = packet->data + 4;
+    NutPunch_MemCpy(ptr, type, sizeof(NP_Header)), ptr += sizeof(NP_Header);
+    ptr += NUTPUNCH_ACKS_SIZE;
+    *ptr++ = channel;
+
+    // reliable ones are numbered per channel too, in case it's ordered on the other end
+    if (reliable)
+        *(uint16_t*)ptr = htons(seq), ptr += 2;
+
+    return ptr;
+}
+
+/// Tells `peer` we gave up on the reliable packet whose channel and its sequence number are at
+/// `channel`, so their end doesn't hold the rest of an ordered channel back waiting for it.
+static void NP_SendSkip(NutPunch_Peer peer, const uint8_t* channel) {
+    if (NutPunch_PeerAlive(peer))
+        NP_StartData("SKIP", *channel, peer, true, ntohs(*(uint16_t*)(channel + 1)), 0);
+}
+
+/// Queues a message for `peer` as a single DATA packet, or as FRAGs if it doesn't fit the path.
+static void NP_QueueData(
+    NutPunch_Channel channel, NutPunch_Peer peer, const void* data, int size, bool reliable) {
+    const int room = NutPunch_PeerMTU(peer) - NUTPUNCH_DATA_OVERHEAD;
+    const int chunk = room - NUTPUNCH_FRAG_HEADER;
+    const int count = size <= room ? 1 : (size + chunk - 1) / chunk;
+
+    if (size > NUTPUNCH_MAX_MESSAGE_SIZE || count > UINT8_MAX) {
+        NP_Warn("Ignoring a huge message (%d bytes)", size);
+        return;
+    }
+
+    // the tunnel isn't a real channel, and nothing on it needs ordering anyway
+    NP_PeerInfo* const info = &NP_Peers[peer];
+    const bool numbered = reliable && channel < NUTPUNCH_MAX_CHANNELS;
+    const uint16_t seq = numbered ? info->channels[channel].send_seq++ : 0;
+
+    if (count == 1) {
+        uint8_t* const ptr = NP_StartData("DATA", channel, peer, reliable, seq, size);
+        if (ptr)
+            NutPunch_MemCpy(ptr, data, size);
+        return;
+    }
+
+    // too big for one packet, so each fragment goes on its own and gets acked on its own
+    const uint16_t number = info->next_message++;
+    for (int i = 0; i < count; i++) {
+        const int len = i + 1 < count ? chunk : size - i * chunk;
+        const size_t total = NUTPUNCH_FRAG_HEADER + len;
+        uint8_t* ptr = NP_StartData("FRAG", channel, peer, reliable, seq, total);
+        if (!ptr)
+            return;
+
+        *(uint16_t*)ptr = htons(number), ptr += 2;
+        *ptr++ = (uint8_t)i, *ptr++ = (uint8_t)count;
+        *(uint16_t*)ptr = htons((uint16_t)chunk), ptr += 2;
+        NutPunch_MemCpy(ptr, (const uint8_t*)data + i * chunk, len);
+    }
 }
 
 static void NP_SendDataPro(
@@ -1863,15 +2983,7 @@ static void NP_SendDataPro(
         return;
     }
 
-    const size_t total_size = sizeof(NP_Header) + 1 + size;
-    uint8_t* const buf = (uint8_t*)NutPunch_Malloc(total_size);
-    uint8_t* ptr = buf + sizeof(NP_Header);
-
-    NutPunch_MemCpy(buf, "DATA", sizeof(NP_Header));
-    *ptr++ = channel, NutPunch_MemCpy(ptr, data, size);
-    NP_JustSend(NP_Peers[peer].address, buf, total_size, reliable);
-
-    NutPunch_Free(buf);
+    NP_QueueData(channel, peer, data, size, reliable);
 }
 
 void NutPunch_Send(NutPunch_Channel channel, NutPunch_Peer peer, const void* data, int size) {
@@ -1898,6 +3010,12 @@ bool NutPunch_PeerAlive(NutPunch_Peer peer) {
     return !NP_AddrNull(NP_Peers[peer].address);
 }
 
+int NutPunch_PeerMTU(NutPunch_Peer peer) {
+    if (!NutPunch_PeerAlive(peer))
+        return 0;
+    return NP_Peers[peer].path.mtu ? NP_Peers[peer].path.mtu : NUTPUNCH_FRAGMENT_SIZE;
+}
+
 int NutPunch_LocalPeer() {
     if (!NutPunch_IsOnline())
         return NUTPUNCH_MAX_PLAYERS;
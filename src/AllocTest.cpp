@@ -0,0 +1,111 @@
+// Runs the NutPuncher's JOIN/BEAT path in-process against a fake clock and fails if it still
+// allocates once warmed up.
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static uint64_t fake_now = 1000 * 1000000000ull;
+static uint64_t fake_clock() {
+    return fake_now;
+}
+
+#define NutPunch_TimeNS fake_clock
+#define main NutPuncher_main
+#include "NutPuncher.cpp"
+#undef main
+
+static std::atomic<size_t> allocations = 0;
+
+void* operator new(std::size_t size) {
+    allocations++;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+static constexpr const int LOBBIES = 8, PLAYERS = 4;
+
+/// Enough to go around the timer wheel's first two rings a couple of times.
+static constexpr const int WARMUP_TICKS = 10000, MEASURED_TICKS = 10000;
+
+static char packets[LOBBIES * PLAYERS][4 + sizeof(NP_Header) + sizeof(NP_Heartbeat)];
+static NP_SockAddr addrs[LOBBIES * PLAYERS];
+
+static void build_packets() {
+    for (int i = 0; i < LOBBIES * PLAYERS; i++) {
+        const int lobby = i / PLAYERS, player = i % PLAYERS;
+
+        char* ptr = packets[i] + 4;
+        std::memcpy(ptr, "JOIN", sizeof(NP_Header)), ptr += sizeof(NP_Header);
+
+        NP_Heartbeat* const beat = reinterpret_cast<NP_Heartbeat*>(ptr);
+        std::snprintf(beat->peer, sizeof(beat->peer), "peer%d", i);
+        std::snprintf(beat->game, sizeof(beat->game), "AllocTest");
+        std::snprintf(beat->lobby, sizeof(beat->lobby), "lobby%d", lobby);
+
+        // the first one in hosts for everyone else
+        beat->flags = player ? NP_HB_JoinExisting : (PLAYERS - 1) << 4;
+
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addrs[i].sin_port = htons((uint16_t)(40000 + i));
+    }
+}
+
+static void run_ticks(int count) {
+    for (int t = 0; t < count; t++) {
+        for (int i = 0; i < LOBBIES * PLAYERS; i++)
+            dispatch(addrs[i], packets[i], sizeof(packets[i]));
+
+        fake_now += TICK;
+        tick();
+    }
+}
+
+int main() {
+    Guard _linganguliguliguli;
+
+    SOCK = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (SOCK == NUTPUNCH_INVALID_SOCKET || !NP_MakeNonblocking(SOCK)) {
+        NP_Warn("Failed to open a socket");
+        return EXIT_FAILURE;
+    }
+
+    build_packets();
+    run_ticks(WARMUP_TICKS);
+
+    allocations = 0;
+    run_ticks(MEASURED_TICKS);
+
+    const size_t count = allocations;
+    if (count) {
+        NP_Warn("%zu allocations over %d warmed-up ticks", count, MEASURED_TICKS);
+        return EXIT_FAILURE;
+    }
+
+    NP_Info("No allocations over %d warmed-up ticks", MEASURED_TICKS);
+    return EXIT_SUCCESS;
+}
@@ -23,18 +23,62 @@
 //
 // For more information, please refer to <https://unlicense.org>
 
+#include <algorithm>
+#include <bit>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define NUTPUNCH_IMPLEMENTATION
 #include <NutPunch.h>
 
+// batched `recvmmsg`/`sendmmsg` I/O; define `NUTPUNCH_NO_MMSG` to force the per-packet fallback.
+#if defined(__linux__) && !defined(NUTPUNCH_NO_MMSG)
+#define NUTPUNCH_MMSG
+#include <netinet/udp.h>
+#endif
+
+// event-driven mainloop; define `NUTPUNCH_NO_EPOLL` to fall back to a fixed-rate sleepy loop.
+#if defined(__linux__) && !defined(NUTPUNCH_NO_EPOLL)
+#define NUTPUNCH_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+// SSE2 lobby filtering kernels; define `NUTPUNCH_NO_SIMD` to use the plain scalar ones.
+#if (defined(__SSE2__) || defined(_M_X64)) && !defined(NUTPUNCH_NO_SIMD)
+#define NUTPUNCH_SSE2
+#include <emmintrin.h>
+#endif
+
+// kernel-side packet steering for the sharded mode.
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+#define NUTPUNCH_STEERING
+#include <linux/filter.h>
+#endif
+
 static constexpr const NutPunch_Clock PEER_TIMEOUT = 3000 * NUTPUNCH_MS;
 
+/// How often to re-send BEATs to a lobby whose state hasn't changed. Changes go out on the next
+/// tick regardless.
+static constexpr const NutPunch_Clock BEAT_KEEPALIVE = 500 * NUTPUNCH_MS;
+
+/// How long to wait before re-sending a BEAT to a player whose heartbeat reports a stale lobby
+/// epoch, so that the BEATs still in flight don't get duplicated.
+static constexpr const NutPunch_Clock RESYNC_DELAY = 200 * NUTPUNCH_MS;
+
 static constexpr const NutPunch_Clock KEEP_QUEUE_FOR = 20 * NUTPUNCH_SEC;
 
 /// a little debouncing delay to prevent recreating a grindr queue right after timing it out.
@@ -42,27 +86,125 @@ static constexpr const NutPunch_Clock GRINDR_DEBOUNCE = 3 * NUTPUNCH_SEC;
 
 static constexpr const size_t MAX_LOBBIES = 1024;
 
-static NP_Sock SOCK = NUTPUNCH_INVALID_SOCKET;
+/// How many different LIST replies to remember per game.
+static constexpr const size_t MAX_CACHED_LISTS = 64;
+
+/// How often to update lobbies and matchmaking queues.
+static constexpr const NutPunch_Clock TICK = NUTPUNCH_SEC / 30;
+
+/// How many datagrams to pull/push with a single `recvmmsg`/`sendmmsg` call.
+static constexpr const size_t BATCH_SIZE = 64;
+
+/// Upper limit on worker threads in the sharded mode.
+static constexpr const size_t MAX_SHARDS = 64;
+
+static thread_local NP_Sock SOCK = NUTPUNCH_INVALID_SOCKET;
+
+/// The shard run by the current thread. Each shard owns its own socket, lobbies and queues.
+static thread_local size_t SHARD = 0;
 
 static NutPunch_Clock elapsed(NutPunch_Clock start = 0) {
     return NutPunch_TimeNS() - start;
 }
 
+/// A hierarchical timing wheel with `TICK` granularity: `LEVELS` rings of `SLOTS` buckets, each
+/// ring `SLOTS` times coarser than the one below. Scheduling is O(1), and advancing only touches
+/// buckets that come due plus the occasional coarse bucket cascading into finer ones, so the cost
+/// scales with the timers firing rather than the timers pending.
+///
+/// There's no cancelling. Owners keep the real deadline themselves and re-check it when a timer
+/// fires, rescheduling if it moved in the meantime (e.g. a player heartbeated).
+template <typename T> struct TimerWheel {
+    static constexpr const size_t BITS = 6, SLOTS = 1 << BITS, LEVELS = 4;
+
+    struct Timer {
+        uint64_t due;
+        T what;
+    };
+
+    std::vector<Timer> slots[LEVELS][SLOTS], due;
+    std::vector<std::vector<Timer>> spare; // storage of drained slots, for the next ones to fill
+    uint64_t now = NutPunch_TimeNS() / TICK;
+    size_t pending = 0;
+
+    void schedule(NutPunch_Clock when, T what) {
+        insert({std::max(when / TICK, now + 1), std::move(what)});
+        pending++;
+    }
+
+    template <typename F> void advance(NutPunch_Clock until, F&& fire) {
+        for (const uint64_t target = until / TICK; now < target;) {
+            if (!pending) {
+                now = target;
+                break;
+            }
+
+            now++;
+
+            for (size_t level = 1; level < LEVELS; level++) {
+                const size_t shift = BITS * level;
+                if (now & ((1ull << shift) - 1))
+                    break;
+
+                auto& slot = slots[level][(now >> shift) & (SLOTS - 1)];
+                due.swap(slot);
+                for (auto& timer : due)
+                    insert(std::move(timer));
+                recycle(slot);
+            }
+
+            auto& slot = slots[0][now & (SLOTS - 1)];
+            due.swap(slot);
+            pending -= due.size();
+
+            for (auto& timer : due)
+                fire(std::move(timer.what));
+            recycle(slot);
+        }
+    }
+
+private:
+    /// Puts the storage of a slot that's been swapped into `due` aside for whichever slot fills up
+    /// next. Handing it back to the same slot isn't enough, since timers scheduled at a fixed
+    /// delay can take ages to come around to every slot, and a fresh one would allocate.
+    void recycle(std::vector<Timer>& slot) {
+        due.clear();
+        if (due.capacity())
+            spare.emplace_back().swap(due);
+    }
+
+    void insert(Timer timer) {
+        constexpr const uint64_t horizon = (1ull << (BITS * LEVELS)) - 1;
+
+        // anything past the horizon parks in the coarsest ring and cascades until it's in range
+        const uint64_t when = std::min(std::max(timer.due, now), now + horizon), delta = when - now;
+
+        size_t level = 0;
+        while (level + 1 < LEVELS && delta >= (1ull << (BITS * (level + 1))))
+            level++;
+
+        auto& slot = slots[level][(when >> (BITS * level)) & (SLOTS - 1)];
+        if (!slot.capacity() && !spare.empty())
+            slot.swap(spare.back()), spare.pop_back();
+        slot.push_back(std::move(timer));
+    }
+};
+
 struct Message {
     NP_SockAddr from;
     const char* data;
     int len;
 
-    std::string read(size_t count) {
+    std::string_view read(size_t count) {
         const char* x = data;
         data += count, len -= (int)count;
-        return std::string(x, count);
+        return {x, count};
     }
 
-    std::string read0term(size_t n) {
+    std::string_view read0term(size_t n) {
         const char* x = data;
         data += n, len -= (int)n;
-        return std::string(x, strnlen(x, n));
+        return {x, strnlen(x, n)};
     }
 
     template <typename T> T read() {
@@ -74,56 +216,34 @@ struct Message {
 
 struct Lobby;
 
+/// A lobby's game ID and name, zero-padded to their full size so they can be hashed and compared
+/// as plain bytes.
 struct LobbyId {
-    std::string game, name;
+    NutPunch_GameId game = {0};
+    NutPunch_LobbyName name = {0};
 
     LobbyId() {}
 
-    LobbyId(const std::string& game, const std::string& name) : game(game), name(name) {}
-
-    bool operator==(const LobbyId& other) const {
-        return game == other.game && name == other.name;
+    LobbyId(std::string_view game, std::string_view name) {
+        std::memcpy(this->game, game.data(), std::min(game.size(), sizeof(this->game)));
+        std::memcpy(this->name, name.data(), std::min(name.size(), sizeof(this->name)));
     }
-};
-
-namespace std {
 
-template <> struct hash<LobbyId> {
-    std::size_t operator()(const LobbyId& id) const noexcept {
-        return std::hash<std::string>{}(id.game) ^ (std::hash<std::string>{}(id.name) << 1);
+    bool operator==(const LobbyId& other) const {
+        return !std::memcmp(this, &other, sizeof(*this));
     }
-};
-
-} // namespace std
-
-static std::unordered_map<LobbyId, Lobby> lobbies;
 
-static const char* fmt_lobby_name(const std::string& id) {
-    static char buf[sizeof(NutPunch_LobbyName) + 1] = {0};
+    uint64_t hash() const {
+        static_assert(sizeof(LobbyId) % sizeof(uint64_t) == 0);
 
-    for (int i = 0; i < sizeof(NutPunch_LobbyName); i++) {
-        const char c = id[i];
-        const bool alpha = c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z',
-                   numeric = c >= '0' && c <= '9';
-        if (alpha || numeric || c == '-' || c == '_') {
-            buf[i] = c;
-        } else if (!c) {
-            buf[i] = 0;
-            return buf;
-        } else {
-            buf[i] = ' ';
-        }
-    }
+        uint64_t words[sizeof(LobbyId) / sizeof(uint64_t)], hash = 0;
+        std::memcpy(words, this, sizeof(words));
 
-    for (int i = sizeof(NutPunch_LobbyName); i > 0; i--) {
-        if (buf[i - 1] != ' ' && buf[i - 1] != 0) {
-            buf[i] = 0;
-            return buf;
-        }
+        for (const uint64_t word : words)
+            hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+        return hash ^ hash >> 29;
     }
-
-    return buf;
-}
+};
 
 static bool match_field_value(const int diff, const int flags) {
     bool result = false;
@@ -139,328 +259,1223 @@ static bool match_field_value(const int diff, const int flags) {
     return (flags & NPF_Not) ? !result : result;
 }
 
-static void just_send(NP_SockAddr addr, const void* buf, size_t len) {
-    const int prefix = 4;
+/// How many lobbies a columnar scan compares at once.
+static constexpr const size_t LANES = 16;
 
-    if (prefix + len > NUTPUNCH_FRAGMENT_SIZE)
-        return; // womp womp womp
+/// Per-lane comparison masks of a columnar scan: bit `i` is set if lobby `i` of the block is
+/// less than/greater than/equal to the value being compared against.
+struct LaneCmp {
+    uint32_t lt, gt, eq;
+};
 
-    if (NP_AddrNull(addr) || SOCK == NUTPUNCH_INVALID_SOCKET)
-        return;
+#ifdef NUTPUNCH_SSE2
 
-    const auto prepend = std::make_unique<char[]>(prefix + len);
-    *reinterpret_cast<uint32_t*>(prepend.get()) = htonl(0);
-    memcpy(prepend.get() + prefix, buf, len);
+static LaneCmp compare_lanes(const uint8_t* column, uint8_t value) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)column), x = _mm_set1_epi8((char)value);
+    const __m128i eq = _mm_cmpeq_epi8(v, x), le = _mm_cmpeq_epi8(_mm_min_epu8(v, x), v);
 
-    const auto shit = (const struct sockaddr*)&addr;
-    sendto(SOCK, prepend.get(), prefix + (int)len, 0, shit, sizeof(addr));
+    const uint32_t eq_bits = _mm_movemask_epi8(eq), le_bits = _mm_movemask_epi8(le);
+    return {le_bits & ~eq_bits, ~le_bits & 0xFFFF, eq_bits};
 }
 
-static void gtfo(NP_SockAddr addr, NutPunch_ErrorCode error) {
-    static uint8_t buf[sizeof(NP_Header) + 1] = "GTFO";
-    buf[sizeof(NP_Header)] = error;
-    just_send(addr, buf, sizeof(buf));
-}
+static LaneCmp compare_lanes(
+    const std::vector<uint8_t>* planes, size_t block, const uint8_t* value, size_t len) {
+    __m128i lt = _mm_setzero_si128(), gt = lt, undecided = _mm_cmpeq_epi8(lt, lt);
 
-struct Metadata {
-    std::unordered_map<std::string, std::string> fields;
+    for (size_t k = 0; k < len; k++) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(planes[k].data() + block));
+        const __m128i x = _mm_set1_epi8((char)value[k]);
+        const __m128i eq = _mm_cmpeq_epi8(v, x), le = _mm_cmpeq_epi8(_mm_min_epu8(v, x), v);
 
-    Metadata() {}
+        lt = _mm_or_si128(lt, _mm_andnot_si128(eq, _mm_and_si128(undecided, le)));
+        gt = _mm_or_si128(gt, _mm_andnot_si128(le, undecided));
+        undecided = _mm_and_si128(undecided, eq);
 
-    bool insert(const std::string& name, const std::string& data) {
-        if (name.empty())
-            return false;
-        if (fields.size() >= NUTPUNCH_MAX_FIELDS)
-            return false;
-        fields.insert_or_assign(name, data);
-        return true;
+        if (!_mm_movemask_epi8(undecided))
+            break;
     }
 
-    char* dump(char* out) const {
-        for (const auto& pair : fields) {
-            const char *name = pair.first.c_str(), *data = pair.second.c_str();
-
-            auto len = pair.first.length() + 1;
-            out = NP_Print(out, name, len);
+    return {(uint32_t)_mm_movemask_epi8(lt), (uint32_t)_mm_movemask_epi8(gt),
+        (uint32_t)_mm_movemask_epi8(undecided)};
+}
 
-            len = pair.second.length() + 1;
-            out = NP_Print(out, data, len);
-        }
+#else
 
-        return out;
-    }
+static LaneCmp compare_lanes(const uint8_t* column, uint8_t value) {
+    LaneCmp result = {0};
 
-    uint8_t* dump(uint8_t* out) const {
-        return (uint8_t*)dump((char*)out);
+    for (size_t i = 0; i < LANES; i++) {
+        if (column[i] < value)
+            result.lt |= 1 << i;
+        else if (column[i] > value)
+            result.gt |= 1 << i;
+        else
+            result.eq |= 1 << i;
     }
 
-    void load(const char* ptr, size_t len) {
-        const char *start = ptr, *in = ptr;
-
-        NutPunch_FieldName name;
-        NutPunch_FieldValue data;
+    return result;
+}
 
-        while (in < start + len) {
-            in = NP_ReadUntilNull(name, sizeof(name), start, in, len);
-            in = NP_ReadUntilNull(data, sizeof(data), start, in, len);
+static LaneCmp compare_lanes(
+    const std::vector<uint8_t>* planes, size_t block, const uint8_t* value, size_t len) {
+    LaneCmp result = {0, 0, (1 << LANES) - 1};
 
-            if (insert(name, data))
-                NP_Trace("\"%s\" = \"%s\"", name, data);
-        }
+    for (size_t k = 0; k < len && result.eq; k++) {
+        const LaneCmp step = compare_lanes(planes[k].data() + block, value[k]);
+        result.lt |= result.eq & step.lt, result.gt |= result.eq & step.gt;
+        result.eq &= step.eq;
     }
 
-    void reset() {
-        fields.clear();
-    }
-};
+    return result;
+}
 
-struct Player {
-    NutPunch_Peer index = 0;
-    NP_SockAddr pub, same_nat;
-    std::string id;
-    NutPunch_Clock last_beat;
+#endif
 
-    Player(NutPunch_Peer index, NP_SockAddr pub, NP_SockAddr same_nat, const std::string& id)
-        : index(index), pub(pub), same_nat(same_nat), id(id), last_beat(elapsed()) {}
+/// Lets string-keyed maps be searched with a `std::string_view` without allocating a key.
+struct BytesHash {
+    using is_transparent = void;
 
-    void beat() {
-        last_beat = elapsed();
+    size_t operator()(std::string_view key) const {
+        return std::hash<std::string_view>{}(key);
     }
 };
 
-static void cleanup_players_list(std::vector<Player>& players) {
-    std::erase_if(players, [](const auto& player) {
-        if (elapsed(player.last_beat) >= PEER_TIMEOUT) {
-            NP_Info("%s timed out", player.id.c_str());
-            return true;
-        }
+/// Listed lobbies of a game. Also keeps them sorted by every metadata field and special field, so a
+/// filtered LIST can pick its candidates from an index range instead of checking every lobby.
+struct Listing {
+    using Bucket = std::unordered_set<const Lobby*>;
+    using Buckets = std::vector<const Bucket*>;
 
-        return false;
-    });
-}
+    Bucket lobbies;
+    std::unordered_map<std::string, std::map<std::string, Bucket>> fields;
+    std::map<int, Bucket> specials[NPSF_Capacity + 1];
 
-struct Lobby {
-    std::string name, game;
+    struct Reply {
+        uint64_t epoch;
+        std::string bytes;
+    };
 
-    uint8_t capacity = 1; // HACK: capacity is set to 1 when the lobby is created, but then it's set
-                          // to the actual value when the host joins and heartbeats
+    /// Bumped whenever a listed lobby changes in a way a LIST could notice, which makes every
+    /// cached reply stale.
+    uint64_t epoch = 0;
 
-    bool unlisted = true; // same hack here...
+    /// Serialized LIST replies keyed by the raw filter bytes they answer.
+    std::unordered_map<std::string, Reply, BytesHash, std::equal_to<>> replies;
 
-    std::vector<Player> players;
-    Metadata metadata;
+    /// A metadata field of every row, stored one byte plane per value character so a block of
+    /// `LANES` rows can be compared in one go.
+    struct Column {
+        size_t count = 0;
+        std::vector<uint8_t> present, planes[sizeof(NutPunch_FieldValue)];
+    };
 
-    Lobby() {} // only needed for stuffing this in a vector
+    /// Columnar copy of the same lobbies for when the indices can't narrow a LIST down. Lobby
+    /// `rows[i]` sits at `i` in every column, and columns are padded to a multiple of `LANES`.
+    std::vector<Lobby*> rows;
+    std::vector<uint8_t> special_columns[NPSF_Capacity + 1];
+    std::unordered_map<std::string, Column> columns;
 
-    Lobby(const std::string& game, const std::string& name) : game(game), name(name) {}
+    void pad_column(Column& column) const {
+        const size_t padded = (rows.size() + LANES - 1) / LANES * LANES;
+        if (column.present.size() >= padded)
+            return;
 
-    const char* fmt_id() const {
-        return fmt_lobby_name(name);
+        column.present.resize(padded);
+        for (auto& plane : column.planes)
+            plane.resize(padded);
     }
 
-    void update() {
-        for (auto& player : players)
-            beat(player);
-        cleanup_players_list(players);
-    }
+    size_t add_row(Lobby* lobby) {
+        rows.push_back(lobby);
 
-    int special(uint8_t idx) const {
-        switch (idx) {
-        case NPSF_Capacity:
-            return capacity;
-        case NPSF_Players:
-            return (int)players.size();
-        default:
-            return 0;
-        }
-    }
+        const size_t padded = (rows.size() + LANES - 1) / LANES * LANES;
+        for (auto& column : special_columns)
+            column.resize(padded);
+        for (auto& [name, column] : columns)
+            pad_column(column);
 
-    explicit operator bool() const {
-        return players.size() > 0;
+        return rows.size() - 1;
     }
 
-    NutPunch_Peer index_of(const std::string& id) const {
-        for (size_t i = 0; i < players.size(); i++)
-            if (id == players[i].id)
-                return i;
-        return NUTPUNCH_MAX_PLAYERS;
-    }
+    void drop_row(size_t row);
 
-    bool has(const std::string& id) const {
-        return index_of(id) != NUTPUNCH_MAX_PLAYERS;
+    void put_special(size_t row, uint8_t idx, int value) {
+        special_columns[idx][row] = (uint8_t)std::min(value, 0xFF);
     }
 
-    void accept(const std::string& id, const NP_HeartbeatFlagsStorage flags, Message msg) {
-        NP_SockAddr same_nat = {0};
-
-        same_nat.sin_family = AF_INET;
-        same_nat.sin_addr.s_addr = msg.read<uint32_t>();
-        same_nat.sin_port = msg.read<uint16_t>();
-
-        // https://docs.libuv.org/en/v1.x/udp.html#c.uv_udp_send
-        if (!ntohl(same_nat.sin_addr.s_addr))
-            same_nat.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    /// Sets or clears (with a null `value`) a row's metadata field.
+    void put_field(size_t row, const std::string& name, const char* value) {
+        auto& column = columns[name];
+        pad_column(column);
 
-        if (index_of(id) == NUTPUNCH_MAX_PLAYERS) {
-            if (players.size() >= capacity) {
-                gtfo(msg.from, NPE_LobbyFull);
-                return;
-            }
+        column.count += !column.present[row] - !value;
+        column.present[row] = value ? 0xFF : 0;
+        for (size_t k = 0; value && k < sizeof(NutPunch_FieldValue); k++)
+            column.planes[k][row] = value[k];
+    }
 
-            NutPunch_Peer idx = 0;
+    /// Runs `filters` over every row, a block of `LANES` rows at a time, and calls `emit` with
+    /// each matching lobby until it returns `false`. Same semantics as `Lobby::match_against`.
+    template <typename F>
+    void scan(const NutPunch_Filter* filters, size_t filter_count, F&& emit) const {
+        struct Probe {
+            const std::vector<uint8_t>* column = nullptr;
+            const Column* field = nullptr;
+            uint8_t value[sizeof(NutPunch_FieldValue)];
+            size_t len = 0;
+            int flags;
+        } probes[NUTPUNCH_MAX_SEARCH_FILTERS];
+
+        size_t probe_count = 0;
+        for (size_t f = 0; f < filter_count; f++) {
+            const auto& filter = filters[f];
+            auto& probe = probes[probe_count];
+            probe.flags = filter.comparison;
 
-            for (; idx < capacity; idx++) {
-                bool good = true;
+            if (filter.field.alwayszero) {
+                const uint8_t idx = filter.special.index, value = filter.special.value;
 
-                for (const auto& player : players) {
-                    if (player.index == idx) {
-                        good = false;
-                        break;
-                    }
+                if (idx > NPSF_Capacity) { // always compares against zero
+                    if (match_field_value(value, probe.flags))
+                        continue;
+                    return;
                 }
 
-                if (good)
-                    break;
-            }
+                probe.column = &special_columns[idx], probe.value[0] = value;
+            } else {
+                const auto& field = filter.field;
+                const std::string name(field.name, strnlen(field.name, sizeof(NutPunch_FieldName)));
 
-            players.emplace_back(idx, msg.from, same_nat, id);
-            NP_Info("Player %d joined lobby '%s'", idx + 1, fmt_id());
-        }
+                const auto it = columns.find(name);
+                if (it == columns.end())
+                    return;
 
-        for (auto& player : players) {
-            if (player.id == id) {
-                player.beat();
-                break;
+                probe.field = &it->second;
+                probe.len = strnlen(field.value, sizeof(NutPunch_FieldValue));
+                std::memcpy(probe.value, field.value, probe.len);
             }
-        }
 
-        if (index_of(id) == master()) {
-            unlisted = flags & NP_HB_Unlisted;
-            capacity = 1 + (flags >> 4);
-            metadata.load(msg.data, msg.len);
+            probe_count++;
         }
-    }
 
-    void beat(Player& player) {
-        static uint8_t buf[sizeof(NP_Header) + sizeof(NP_BeatingAppend)] = "BEAT";
-        uint8_t* ptr = buf + sizeof(NP_Header);
-
-        *ptr++ = unlisted;
-        *ptr++ = player.index;
-        *ptr++ = master();
-        *ptr++ = (NutPunch_Peer)players.size();
-        *ptr++ = capacity;
+        for (size_t block = 0; block < rows.size(); block += LANES) {
+            const size_t left = rows.size() - block;
+            uint32_t hits = left >= LANES ? (1 << LANES) - 1 : (1 << left) - 1;
+
+            for (size_t p = 0; p < probe_count && hits; p++) {
+                const auto& probe = probes[p];
+                uint32_t result = 0, present = (1 << LANES) - 1, below, above;
+                LaneCmp cmp;
+
+                if (probe.field) {
+                    cmp = compare_lanes(probe.field->planes, block, probe.value, probe.len);
+                    present = compare_lanes(probe.field->present.data() + block, 0).gt;
+                    below = cmp.gt, above = cmp.lt; // see `Lobby::match_against`
+                } else {
+                    cmp = compare_lanes(probe.column->data() + block, probe.value[0]);
+                    below = cmp.lt, above = cmp.gt;
+                }
 
-        for (const auto& player : players) {
-            *ptr++ = player.index;
+                if (probe.flags & NPF_Greater)
+                    result |= above;
+                else if (probe.flags & NPF_Less)
+                    result |= below;
 
-            memcpy(ptr, &player.pub.sin_addr.s_addr, 4), ptr += 4;
-            memcpy(ptr, &player.pub.sin_port, 2), ptr += 2;
+                if (probe.flags & NPF_Eq)
+                    result |= cmp.eq;
 
-            memcpy(ptr, &player.same_nat.sin_addr.s_addr, 4), ptr += 4;
-            memcpy(ptr, &player.same_nat.sin_port, 2), ptr += 2;
-        }
+                if (probe.flags & NPF_Not)
+                    result = ~result;
 
-        ptr = metadata.dump(ptr);
+                hits &= result & present;
+            }
 
-        just_send(player.pub, buf, ptr - buf);
+            for (; hits; hits &= hits - 1)
+                if (!emit(rows[block + std::countr_zero(hits)]))
+                    return;
+        }
     }
 
-    void kill_bro(const NutPunch_PeerId id, NP_SockAddr pub) {
-        std::erase_if(players, [id, pub](const auto& player) {
-            if (player.id != id && !NP_AddrEq(player.pub, pub))
-                return false;
-            NP_Info("Player %d disconnected gracefully", player.index + 1);
-            return true;
-        });
+    template <typename K>
+    static void file(std::map<K, Bucket>& index, const K& key, const Lobby* lobby, bool add) {
+        if (add) {
+            index[key].insert(lobby);
+            return;
+        }
+
+        const auto it = index.find(key);
+        if (it != index.end() && it->second.erase(lobby) && it->second.empty())
+            index.erase(it);
     }
 
-    bool match_against(const NutPunch_Filter* filters, size_t filter_count) const {
-        for (int f = 0; f < filter_count; f++) {
-            const auto& filter = filters[f];
+    /// Collects the buckets matching a filter's comparison into `out`. `[eq, past)` are the keys
+    /// equal to the filter value, and `up` tells whether `NPF_Greater` means keys above them.
+    template <typename K>
+    static void select(const std::map<K, Bucket>& index, std::map<K, Bucket>::const_iterator eq,
+        std::map<K, Bucket>::const_iterator past, int flags, bool up, Buckets& out) {
+        const bool side = flags & (NPF_Greater | NPF_Less);
+        if (flags & NPF_Less && !(flags & NPF_Greater))
+            up = !up;
+
+        auto first = side ? (up ? past : index.begin()) : eq;
+        auto last = side ? (up ? index.end() : eq) : eq;
+
+        if (flags & NPF_Eq) {
+            if (!side || up)
+                first = eq;
+            if (!side || !up)
+                last = past;
+        }
 
-            if (filter.field.alwayszero != 0) {
-                int diff = (uint8_t)filter.special.value;
-                diff -= special(filter.special.index);
+        for (; first != last; ++first)
+            out.push_back(&first->second);
+    }
 
-                if (match_field_value(diff, filter.comparison))
-                    continue;
+    /// Fills `out` with the buckets holding every lobby that could match `filter`. Returns `false`
+    /// if the filter can't be answered from an index.
+    bool narrow(const NutPunch_Filter& filter, Buckets& out) const {
+        out.clear();
 
+        if (filter.field.alwayszero) {
+            const uint8_t idx = filter.special.index;
+            if (filter.comparison & NPF_Not || idx > NPSF_Capacity)
                 return false;
-            }
 
-            const auto& field = filter.field;
-            const std::string name(field.name, strnlen(field.name, sizeof(NutPunch_FieldName)));
+            const auto& index = specials[idx];
+            const int value = (uint8_t)filter.special.value;
 
-            if (!metadata.fields.contains(name))
-                return false;
+            select(index, index.lower_bound(value), index.upper_bound(value), filter.comparison,
+                true, out);
+            return true;
+        }
 
-            const std::string& data = metadata.fields.at(name);
-            const int diff = std::memcmp(data.c_str(), filter.field.value,
-                strnlen(field.value, sizeof(NutPunch_FieldValue)));
+        const auto& field = filter.field;
+        const std::string name(field.name, strnlen(field.name, sizeof(NutPunch_FieldName)));
+        const std::string value(field.value, strnlen(field.value, sizeof(NutPunch_FieldValue)));
 
-            if (match_field_value(diff, filter.comparison))
-                continue;
+        const auto it = fields.find(name);
+        if (it == fields.end())
+            return true; // lobbies without the field never match
 
-            return false;
+        const auto& index = it->second;
+
+        // Negated filters still only ever match lobbies that have the field.
+        if (filter.comparison & NPF_Not) {
+            select(index, index.begin(), index.end(), NPF_Eq, true, out);
+            return true;
         }
 
-        return true;
-    }
+        // Field filters compare the value's prefix, and the prefix matches are contiguous. Also,
+        // `NPF_Greater` on a field means the lobby's value is *below* the filter's.
+        auto eq = index.lower_bound(value), past = eq;
+        while (past != index.end() && !past->first.compare(0, value.size(), value))
+            ++past;
 
-    NutPunch_Peer master() {
-        for (const auto& player : players)
-            return player.index;
-        return NUTPUNCH_MAX_PLAYERS;
+        select(index, eq, past, filter.comparison, false, out);
+        return true;
     }
 };
 
-// TODO: fucking nuke.
-struct Grindr {
-    const std::string game_id;
-    NutPunch_Clock last_match = NutPunch_TimeNS();
-    std::unordered_map<std::string, Player> players;
-    bool closing = false;
-
-    static constexpr const size_t MATCH = 2;
+static thread_local std::unordered_map<std::string, Listing, BytesHash, std::equal_to<>> listings;
 
-    Grindr(const std::string& game_id) : game_id(game_id) {}
+static const char* fmt_lobby_name(const char* id) {
+    static thread_local char buf[sizeof(NutPunch_LobbyName) + 1] = {0};
 
-    explicit operator bool() const {
-        return elapsed(last_match) <= KEEP_QUEUE_FOR + GRINDR_DEBOUNCE;
+    for (int i = 0; i < sizeof(NutPunch_LobbyName); i++) {
+        const char c = id[i];
+        const bool alpha = c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z',
+                   numeric = c >= '0' && c <= '9';
+        if (alpha || numeric || c == '-' || c == '_') {
+            buf[i] = c;
+        } else if (!c) {
+            buf[i] = 0;
+            return buf;
+        } else {
+            buf[i] = ' ';
+        }
     }
 
-    void accept(const std::string& peer_id, NP_SockAddr pub) {
-        if (players.contains(peer_id))
-            return;
+    for (int i = sizeof(NutPunch_LobbyName); i > 0; i--) {
+        if (buf[i - 1] != ' ' && buf[i - 1] != 0) {
+            buf[i] = 0;
+            return buf;
+        }
+    }
 
-        players.emplace(peer_id, Player(0, pub, {0}, peer_id));
-        closing = false;
+    return buf;
+}
 
-        NP_Info("QUEUE: Added peer '%s' (%s)", peer_id.c_str(), game_id.c_str());
-        last_match = NutPunch_TimeNS(); // necrobump
+#ifdef NUTPUNCH_MMSG
+
+/// Outgoing datagrams waiting for the next `sendmmsg`. Filled by `just_send`, emptied by
+/// `flush_sends` once per receive drain/tick.
+static thread_local struct {
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE][2]; // the second one points at a body shared by `just_send_many`
+    NP_SockAddr addrs[BATCH_SIZE];
+    char bufs[BATCH_SIZE][NUTPUNCH_FRAGMENT_SIZE];
+    unsigned int count;
+} outbox = {};
+
+static void flush_sends() {
+    for (unsigned int i = 0; i < outbox.count;) {
+        errno = 0; // so a zero return can't be mistaken for a fresh EINTR
+        const int sent = sendmmsg(SOCK, outbox.msgs + i, outbox.count - i, 0);
+
+        if (sent > 0) {
+            i += sent;
+        } else if (sent < 0 && NP_SockError() == NP_WouldBlock) {
+            break; // the socket buffer is full; drop the rest like a plain `sendto` would
+        } else if (sent < 0 && NP_SockError() == EINTR) {
+            continue;
+        } else {
+            i++; // skip the datagram the kernel choked on and push the rest through
+        }
     }
 
-    void update() {
-        if (closing)
-            return;
+    outbox.count = 0;
+}
 
-        if (players.size() < MATCH && elapsed(last_match) > KEEP_QUEUE_FOR) {
-            if (!closing) {
-                for (const auto& [id, player] : players)
-                    gtfo(player.pub, NPE_QueueNoMatch);
+static void just_send(NP_SockAddr addr, const void* buf, size_t len) {
+    const int prefix = 4;
 
-                players.clear();
-                closing = true;
+    if (prefix + len > NUTPUNCH_FRAGMENT_SIZE)
+        return; // womp womp womp
+
+    if (NP_AddrNull(addr) || SOCK == NUTPUNCH_INVALID_SOCKET)
+        return;
+
+    if (outbox.count >= BATCH_SIZE)
+        flush_sends();
+
+    const unsigned int idx = outbox.count++;
+    char* const out = outbox.bufs[idx];
+
+    *reinterpret_cast<uint32_t*>(out) = htonl(0);
+    memcpy(out + prefix, buf, len);
+
+    outbox.addrs[idx] = addr;
+    outbox.iovs[idx][0] = {out, prefix + len};
+
+    auto& hdr = outbox.msgs[idx].msg_hdr;
+    hdr = {};
+    hdr.msg_name = &outbox.addrs[idx], hdr.msg_namelen = sizeof(NP_SockAddr);
+    hdr.msg_iov = outbox.iovs[idx], hdr.msg_iovlen = 1;
+}
+
+/// Sends `body` to `count` addresses, each copy preceded by its own `head_len` bytes out of
+/// `heads`. The body gets copied into the outbox once per batch and gathered from there.
+static void just_send_many(const NP_SockAddr* addrs, const uint8_t* heads, size_t head_len,
+    size_t count, const void* body, size_t body_len) {
+    const int prefix = 4;
+
+    if (prefix + head_len + body_len > NUTPUNCH_FRAGMENT_SIZE || SOCK == NUTPUNCH_INVALID_SOCKET)
+        return;
+
+    const char* shared = nullptr;
+
+    for (size_t i = 0; i < count; i++, heads += head_len) {
+        if (NP_AddrNull(addrs[i]))
+            continue;
+
+        if (outbox.count >= BATCH_SIZE)
+            flush_sends(), shared = nullptr;
+
+        const unsigned int idx = outbox.count++;
+        char* const out = outbox.bufs[idx];
+
+        *reinterpret_cast<uint32_t*>(out) = htonl(0);
+        memcpy(out + prefix, heads, head_len);
+
+        if (!shared) {
+            memcpy(out + prefix + head_len, body, body_len);
+            shared = out + prefix + head_len;
+        }
+
+        outbox.addrs[idx] = addrs[i];
+        outbox.iovs[idx][0] = {out, prefix + head_len};
+        outbox.iovs[idx][1] = {(void*)shared, body_len};
+
+        auto& hdr = outbox.msgs[idx].msg_hdr;
+        hdr = {};
+        hdr.msg_name = &outbox.addrs[idx], hdr.msg_namelen = sizeof(NP_SockAddr);
+        hdr.msg_iov = outbox.iovs[idx], hdr.msg_iovlen = 2;
+    }
+}
+
+#else
+
+static void flush_sends() {}
+
+static void just_send(NP_SockAddr addr, const void* buf, size_t len) {
+    const int prefix = 4;
+
+    if (prefix + len > NUTPUNCH_FRAGMENT_SIZE)
+        return; // womp womp womp
+
+    if (NP_AddrNull(addr) || SOCK == NUTPUNCH_INVALID_SOCKET)
+        return;
+
+    static thread_local char out[NUTPUNCH_FRAGMENT_SIZE];
+    *reinterpret_cast<uint32_t*>(out) = htonl(0);
+    memcpy(out + prefix, buf, len);
+
+    const auto shit = (const struct sockaddr*)&addr;
+    sendto(SOCK, out, prefix + (int)len, 0, shit, sizeof(addr));
+}
+
+static void just_send_many(const NP_SockAddr* addrs, const uint8_t* heads, size_t head_len,
+    size_t count, const void* body, size_t body_len) {
+    const int prefix = 4;
+
+    if (prefix + head_len + body_len > NUTPUNCH_FRAGMENT_SIZE || SOCK == NUTPUNCH_INVALID_SOCKET)
+        return;
+
+    // no gathering without `sendmmsg`, but at least the body only gets copied in once
+    static thread_local char out[NUTPUNCH_FRAGMENT_SIZE];
+    *reinterpret_cast<uint32_t*>(out) = htonl(0);
+    memcpy(out + prefix + head_len, body, body_len);
+
+    for (size_t i = 0; i < count; i++, heads += head_len) {
+        if (NP_AddrNull(addrs[i]))
+            continue;
+
+        memcpy(out + prefix, heads, head_len);
+
+        const auto shit = (const struct sockaddr*)&addrs[i];
+        sendto(SOCK, out, prefix + (int)(head_len + body_len), 0, shit, sizeof(addrs[i]));
+    }
+}
+
+#endif
+
+static void gtfo(NP_SockAddr addr, NutPunch_ErrorCode error) {
+    static thread_local uint8_t buf[sizeof(NP_Header) + 1] = "GTFO";
+    buf[sizeof(NP_Header)] = error;
+    just_send(addr, buf, sizeof(buf));
+}
+
+/// A vector with its storage inline, for records that have to stay trivially copyable.
+template <typename T, size_t N> struct InlineVec {
+    T items[N];
+    size_t count = 0;
+
+    T* begin() {
+        return items;
+    }
+
+    T* end() {
+        return items + count;
+    }
+
+    const T* begin() const {
+        return items;
+    }
+
+    const T* end() const {
+        return items + count;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    T& operator[](size_t i) {
+        return items[i];
+    }
+
+    const T& operator[](size_t i) const {
+        return items[i];
+    }
+
+    template <typename... Args> T& emplace_back(Args&&... args) {
+        if (count >= N) {
+            NP_Warn("InlineVec of %zu overflowed, which is a bug", N);
+            std::abort();
+        }
+
+        return items[count++] = T(std::forward<Args>(args)...);
+    }
+
+    void erase(T* it) {
+        std::copy(it + 1, end(), it), count--;
+    }
+
+    void clear() {
+        count = 0;
+    }
+};
+
+struct Metadata {
+    struct Field {
+        NutPunch_FieldName name;
+        NutPunch_FieldValue value;
+    };
+
+    InlineVec<Field, NUTPUNCH_MAX_FIELDS> fields;
+    uint32_t hash = 0; // `NP_HashMetadata` of the fields, kept up to date by `insert`
+
+    const Field* find(std::string_view name) const {
+        for (const auto& field : fields)
+            if (name == field.name)
+                return &field;
+        return nullptr;
+    }
+
+    /// Sets a field, calling `refile(name, false)` before and `refile(name, true)` after its value
+    /// actually changes. Returns `true` if it did.
+    template <typename F>
+    bool insert(const NutPunch_FieldName& name, const NutPunch_FieldValue& data, F&& refile) {
+        if (!name[0])
+            return false;
+
+        auto* field = (Field*)find(name);
+        if (!field) {
+            if (fields.size() >= NUTPUNCH_MAX_FIELDS)
+                return false;
+            field = &fields.emplace_back();
+            std::memcpy(field->name, name, sizeof(field->name));
+        } else if (std::memcmp(field->value, data, sizeof(field->value))) {
+            refile(field->name, false);
+            hash -= NP_HashField(field->name, field->value);
+        } else {
+            return false;
+        }
+
+        std::memcpy(field->value, data, sizeof(field->value));
+        hash += NP_HashField(field->name, field->value);
+        refile(field->name, true);
+        return true;
+    }
+
+    char* dump(char* out) const {
+        for (const auto& field : fields) {
+            out = NP_Print(out, field.name, std::strlen(field.name) + 1);
+            out = NP_Print(out, field.value, std::strlen(field.value) + 1);
+        }
+
+        return out;
+    }
+
+    uint8_t* dump(uint8_t* out) const {
+        return (uint8_t*)dump((char*)out);
+    }
+
+    template <typename F> void load(const char* ptr, size_t len, F&& refile) {
+        const char *start = ptr, *in = ptr;
+
+        NutPunch_FieldName name;
+        NutPunch_FieldValue data;
+
+        while (in < start + len) {
+            in = NP_ReadUntilNull(name, sizeof(name), start, in, len);
+            in = NP_ReadUntilNull(data, sizeof(data), start, in, len);
+
+            if (insert(name, data, refile))
+                NP_Trace("\"%s\" = \"%s\"", name, data);
+        }
+    }
+
+    void reset() {
+        fields.clear(), hash = 0;
+    }
+};
+
+static uint64_t addr_key(NP_SockAddr addr) {
+    return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port;
+}
+
+static uint64_t peer_key(const char* id) {
+    uint64_t key = 0;
+    static_assert(sizeof(key) == sizeof(NutPunch_PeerId));
+    memcpy(&key, id, sizeof(key));
+    return key;
+}
+
+/// Where a player sits: their lobby and their `Player::index` in it.
+struct Seat {
+    LobbyId lobby;
+    NutPunch_Peer index;
+
+    bool operator==(const Seat& other) const {
+        return index == other.index && lobby == other.lobby;
+    }
+};
+
+/// Reverse indices from a player's public address/peer ID to their seat. An entry is only ever
+/// erased by the seat it points to, so a stale seat can't unlink a fresher one.
+///
+/// These are per shard, so "one lobby per master" and "one seat per peer" only hold among the games
+/// a shard owns. The same peer can still sit in lobbies of two games that hash to different shards.
+static thread_local std::unordered_map<uint64_t, Seat> seats_by_addr, seats_by_peer;
+
+/// Same as `Seat`, but for matchmaking queues.
+struct QueueSeat {
+    std::string game, peer;
+
+    bool operator==(const QueueSeat& other) const {
+        return game == other.game && peer == other.peer;
+    }
+};
+
+static thread_local std::unordered_map<uint64_t, QueueSeat> queued_by_addr, queued_by_peer;
+
+template <typename K, typename V>
+static void unlink(std::unordered_map<K, V>& index, K key, const V& value) {
+    const auto it = index.find(key);
+    if (it != index.end() && it->second == value)
+        index.erase(it);
+}
+
+struct Player {
+    NutPunch_Peer index = 0;
+    NP_SockAddr pub, same_nat;
+    NutPunch_PeerId id = {0};
+    NutPunch_Clock last_beat, last_sent = 0; // their last heartbeat, our last BEAT to them
+    uint64_t serial; // tells a rejoined player apart from their stale timeout timer
+
+    Player() {}
+
+    Player(NutPunch_Peer index, NP_SockAddr pub, NP_SockAddr same_nat, std::string_view id)
+        : index(index), pub(pub), same_nat(same_nat), last_beat(elapsed()), serial(next_serial()) {
+        std::memcpy(this->id, id.data(), std::min(id.size(), sizeof(this->id)));
+    }
+
+    bool is(std::string_view peer_id) const {
+        return peer_id.size() == sizeof(id) && !std::memcmp(id, peer_id.data(), sizeof(id));
+    }
+
+    std::string peer_id() const {
+        return std::string(id, sizeof(id));
+    }
+
+    void beat() {
+        last_beat = elapsed();
+    }
+
+    static uint64_t next_serial() {
+        static thread_local uint64_t counter = 0;
+        return ++counter;
+    }
+};
+
+struct PlayerTimer {
+    LobbyId lobby;
+    uint64_t serial;
+};
+
+static thread_local TimerWheel<PlayerTimer> player_timers;
+
+static void unseat_elsewhere(std::string_view peer_id, const LobbyId& lobby);
+
+/// A lobby record. Trivially copyable: players and metadata are stored inline, so a lobby is a
+/// single fixed-size allocation out of the lobby pool.
+struct Lobby {
+    LobbyId id;
+
+    uint8_t capacity = 1; // HACK: capacity is set to 1 when the lobby is created, but then it's set
+                          // to the actual value when the host joins and heartbeats
+
+    bool unlisted = true; // same hack here...
+    size_t row = 0;       // in the game's `Listing` columns, if listed
+
+    uint32_t epoch = 1;           // bumped on every change players need to hear about
+    bool dirty = false;           // whether `epoch` changed since the last BEAT broadcast
+    NutPunch_Clock last_push = 0; // time of the last broadcast
+
+    InlineVec<Player, NUTPUNCH_MAX_PLAYERS> players; // in the order they joined
+    Metadata metadata;
+
+    /// Bytes at the start of a BEAT that differ between recipients: the header, `unlisted` (only
+    /// because it comes first) and the recipient's index.
+    static constexpr const size_t BEAT_HEAD = sizeof(NP_Header) + 2;
+
+    /// The rest of the BEAT, shared by everyone and serialized once per `epoch`.
+    uint8_t beat_body[sizeof(NP_Header) + sizeof(NP_BeatingAppend) - BEAT_HEAD];
+    uint16_t beat_len = 0;
+    uint32_t beat_epoch = 0;
+
+    Lobby(const LobbyId& id) : id(id) {}
+
+    std::string_view game() const {
+        return {id.game, strnlen(id.game, sizeof(id.game))};
+    }
+
+    const char* fmt_id() const {
+        return fmt_lobby_name(id.name);
+    }
+
+    /// Broadcasts a BEAT if anything changed since the last one, or if it's time for a keepalive.
+    void update() {
+        if (!dirty && elapsed(last_push) < BEAT_KEEPALIVE)
+            return;
+
+        beat(players.begin(), players.end());
+        dirty = false, last_push = elapsed();
+    }
+
+    /// Marks the lobby state as changed so the next `update()` pushes it out.
+    void touch() {
+        epoch++, dirty = true;
+    }
+
+    int special(uint8_t idx) const {
+        switch (idx) {
+        case NPSF_Capacity:
+            return capacity;
+        case NPSF_Players:
+            return (int)players.size();
+        default:
+            return 0;
+        }
+    }
+
+    explicit operator bool() const {
+        return players.size() > 0;
+    }
+
+    Listing& listing() const {
+        return listings.find(game())->second;
+    }
+
+    void set_unlisted(bool value) {
+        if (unlisted == value)
+            return;
+        touch();
+
+        if (!listings.contains(game()))
+            listings.emplace(game(), Listing());
+
+        auto& listing = this->listing();
+        if (!value)
+            listing.lobbies.insert(this), row = listing.add_row(this);
+        unlisted = false;
+
+        for (const auto& field : metadata.fields)
+            file_field(field.name, !value);
+        file_special(NPSF_Players, !value);
+        file_special(NPSF_Capacity, !value);
+
+        if (value)
+            listing.lobbies.erase(this), listing.drop_row(row);
+        unlisted = value;
+
+        if (listing.lobbies.empty())
+            listings.erase(listings.find(game()));
+    }
+
+    /// Updates this lobby's entry in a special field index. Call with `add = false` before changing
+    /// the field, and with `add = true` after.
+    void file_special(uint8_t idx, bool add) const {
+        if (unlisted)
+            return;
+
+        auto& listing = this->listing();
+        listing.epoch++;
+
+        Listing::file(listing.specials[idx], special(idx), this, add);
+        if (add)
+            listing.put_special(row, idx, special(idx));
+    }
+
+    /// Same as `file_special`, but for metadata fields.
+    void file_field(std::string_view name, bool add) const {
+        const auto* field = metadata.find(name);
+        if (unlisted || !field)
+            return;
+
+        auto& listing = this->listing();
+        listing.epoch++;
+
+        const std::string key(name);
+        auto& index = listing.fields[key];
+
+        Listing::file(index, std::string(field->value), this, add);
+        if (index.empty())
+            listing.fields.erase(key);
+
+        listing.put_field(row, key, add ? field->value : nullptr);
+    }
+
+    void set_capacity(uint8_t value) {
+        // the wire allows up to 16, but `players` and `beat` only ever have room for this many
+        if (value > NUTPUNCH_MAX_PLAYERS)
+            value = NUTPUNCH_MAX_PLAYERS;
+
+        if (capacity == value)
+            return;
+        touch();
+
+        file_special(NPSF_Capacity, false);
+        capacity = value;
+        file_special(NPSF_Capacity, true);
+    }
+
+    NutPunch_Peer index_of(std::string_view id) const {
+        for (const auto& player : players)
+            if (player.is(id))
+                return player.index;
+        return NUTPUNCH_MAX_PLAYERS;
+    }
+
+    bool has(std::string_view id) const {
+        return index_of(id) != NUTPUNCH_MAX_PLAYERS;
+    }
+
+    void accept(std::string_view id, const NP_HeartbeatFlagsStorage flags, Message msg) {
+        NP_SockAddr same_nat = {0};
+
+        same_nat.sin_family = AF_INET;
+        same_nat.sin_addr.s_addr = msg.read<uint32_t>();
+        same_nat.sin_port = msg.read<uint16_t>();
+
+        // https://docs.libuv.org/en/v1.x/udp.html#c.uv_udp_send
+        if (!ntohl(same_nat.sin_addr.s_addr))
+            same_nat.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        const uint32_t their_epoch = ntohl(msg.read<uint32_t>());
+        const uint32_t their_metadata = ntohl(msg.read<uint32_t>());
+
+        if (index_of(id) == NUTPUNCH_MAX_PLAYERS) {
+            if (players.size() >= capacity) {
+                gtfo(msg.from, NPE_LobbyFull);
+                return;
             }
 
+            // only now that they're sure to get a seat here
+            unseat_elsewhere(id, this->id);
+
+            NutPunch_Peer idx = 0;
+
+            for (; idx < capacity; idx++) {
+                bool good = true;
+
+                for (const auto& player : players) {
+                    if (player.index == idx) {
+                        good = false;
+                        break;
+                    }
+                }
+
+                if (good)
+                    break;
+            }
+
+            file_special(NPSF_Players, false);
+            const auto& player = players.emplace_back(idx, msg.from, same_nat, id);
+            file_special(NPSF_Players, true);
+            touch();
+
+            const PlayerTimer timer = {this->id, player.serial};
+            player_timers.schedule(player.last_beat + PEER_TIMEOUT, timer);
+
+            const Seat seat = {this->id, idx};
+            seats_by_addr.insert_or_assign(addr_key(player.pub), seat);
+            seats_by_peer.insert_or_assign(peer_key(id.data()), seat);
+
+            NP_Info("Player %d joined lobby '%s'", idx + 1, fmt_id());
+        }
+
+        Player* player = std::find_if(
+            players.begin(), players.end(), [&id](const auto& player) { return player.is(id); });
+        player->beat();
+
+        if (player->index == master()) {
+            set_unlisted(flags & NP_HB_Unlisted);
+            set_capacity(1 + (flags >> 4));
+
+            if (their_metadata != metadata.hash) // otherwise they didn't even send it
+                metadata.load(msg.data, msg.len, [this](std::string_view name, bool add) {
+                    file_field(name, add);
+                    touch();
+                });
+        }
+
+        // they missed a BEAT; no need to wait for the keepalive if a broadcast isn't coming anyway
+        if (their_epoch != epoch && !dirty && elapsed(player->last_sent) >= RESYNC_DELAY)
+            beat(player, player + 1);
+    }
+
+    /// Sends a BEAT to each player in `[first, last)`.
+    void beat(Player* first, Player* last) {
+        if (beat_epoch != epoch) {
+            uint8_t* ptr = beat_body;
+
+            *ptr++ = master();
+            *ptr++ = (NutPunch_Peer)players.size();
+            *ptr++ = capacity;
+
+            const uint32_t epoch = htonl(this->epoch), hash = htonl(metadata.hash);
+            memcpy(ptr, &epoch, 4), ptr += 4;
+            memcpy(ptr, &hash, 4), ptr += 4;
+
+            for (const auto& player : players) {
+                *ptr++ = player.index;
+
+                memcpy(ptr, &player.pub.sin_addr.s_addr, 4), ptr += 4;
+                memcpy(ptr, &player.pub.sin_port, 2), ptr += 2;
+
+                memcpy(ptr, &player.same_nat.sin_addr.s_addr, 4), ptr += 4;
+                memcpy(ptr, &player.same_nat.sin_port, 2), ptr += 2;
+            }
+
+            ptr = metadata.dump(ptr);
+            beat_len = (uint16_t)(ptr - beat_body), beat_epoch = this->epoch;
+        }
+
+        NP_SockAddr addrs[NUTPUNCH_MAX_PLAYERS];
+        uint8_t heads[NUTPUNCH_MAX_PLAYERS][BEAT_HEAD];
+        size_t count = 0;
+
+        for (Player* player = first; player != last; player++, count++) {
+            memcpy(heads[count], "BEAT", sizeof(NP_Header));
+            heads[count][sizeof(NP_Header)] = unlisted;
+            heads[count][sizeof(NP_Header) + 1] = player->index;
+
+            addrs[count] = player->pub;
+            player->last_sent = elapsed();
+        }
+
+        just_send_many(addrs, heads[0], BEAT_HEAD, count, beat_body, beat_len);
+    }
+
+    bool match_against(const NutPunch_Filter* filters, size_t filter_count) const {
+        for (int f = 0; f < filter_count; f++) {
+            const auto& filter = filters[f];
+
+            if (filter.field.alwayszero != 0) {
+                int diff = (uint8_t)filter.special.value;
+                diff -= special(filter.special.index);
+
+                if (match_field_value(diff, filter.comparison))
+                    continue;
+
+                return false;
+            }
+
+            const auto& field = filter.field;
+            const auto* data
+                = metadata.find({field.name, strnlen(field.name, sizeof(NutPunch_FieldName))});
+
+            if (!data)
+                return false;
+
+            const int diff = std::memcmp(
+                data->value, field.value, strnlen(field.value, sizeof(NutPunch_FieldValue)));
+
+            if (match_field_value(diff, filter.comparison))
+                continue;
+
+            return false;
+        }
+
+        return true;
+    }
+
+    NutPunch_Peer master() const {
+        for (const auto& player : players)
+            return player.index;
+        return NUTPUNCH_MAX_PLAYERS;
+    }
+};
+
+static_assert(std::is_trivially_copyable_v<Lobby>);
+
+void Listing::drop_row(size_t row) {
+    const size_t last = rows.size() - 1;
+
+    if (row != last) {
+        rows[row] = rows[last], rows[row]->row = row;
+
+        for (auto& column : special_columns)
+            column[row] = column[last];
+
+        for (auto& [name, column] : columns) {
+            column.present[row] = column.present[last];
+            for (auto& plane : column.planes)
+                plane[row] = plane[last];
+        }
+    }
+
+    rows.pop_back();
+
+    for (auto& [name, column] : columns)
+        column.present[last] = 0;
+    std::erase_if(columns, [](const auto& pair) { return !pair.second.count; });
+}
+
+/// Fixed-size records carved out of slabs of `SLAB` at a time and recycled through a free list, so
+/// churning through lots of short-lived records doesn't fragment the heap. Slabs are never freed.
+template <typename T, size_t SLAB = 64> struct Pool {
+    union Slot {
+        Slot* next;
+        alignas(T) unsigned char bytes[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> slabs;
+    Slot* free = nullptr;
+
+    template <typename... Args> T* make(Args&&... args) {
+        if (!free) {
+            auto& slab = slabs.emplace_back(std::make_unique<Slot[]>(SLAB));
+            for (size_t i = 0; i < SLAB; i++)
+                slab[i].next = free, free = &slab[i];
+        }
+
+        Slot* slot = free;
+        free = slot->next;
+        return new (slot->bytes) T(std::forward<Args>(args)...);
+    }
+
+    void drop(T* record) {
+        record->~T();
+
+        Slot* slot = (Slot*)record;
+        slot->next = free, free = slot;
+    }
+};
+
+/// Open-addressing lobby table over a fixed slot array that's never more than half full. Keys sit
+/// inline next to their hash, and deletion shifts the following entries back instead of leaving
+/// tombstones, so a lookup is one hash plus a short linear probe.
+struct LobbyTable {
+    static constexpr const size_t SLOTS = std::bit_ceil(2 * MAX_LOBBIES), MASK = SLOTS - 1;
+
+    struct Slot {
+        uint64_t hash;
+        LobbyId id;
+        Lobby* lobby = nullptr;
+    };
+
+    Slot slots[SLOTS];
+    size_t count = 0;
+    Pool<Lobby> pool;
+
+    size_t probe(const LobbyId& id, uint64_t hash) const {
+        size_t i = hash & MASK;
+        while (slots[i].lobby && (slots[i].hash != hash || !(slots[i].id == id)))
+            i = (i + 1) & MASK;
+        return i;
+    }
+
+    Lobby* find(const LobbyId& id) const {
+        return slots[probe(id, id.hash())].lobby;
+    }
+
+    /// Returns `nullptr` if the table is full.
+    Lobby* insert(const LobbyId& id) {
+        if (count >= MAX_LOBBIES)
+            return nullptr;
+
+        const uint64_t hash = id.hash();
+        auto& slot = slots[probe(id, hash)];
+
+        if (!slot.lobby)
+            slot = {hash, id, pool.make(id)}, count++;
+        return slot.lobby;
+    }
+
+    void erase(const LobbyId& id) {
+        size_t i = probe(id, id.hash());
+        if (!slots[i].lobby)
             return;
+
+        pool.drop(slots[i].lobby);
+        slots[i].lobby = nullptr, count--;
+
+        for (size_t j = (i + 1) & MASK; slots[j].lobby; j = (j + 1) & MASK) {
+            const size_t home = slots[j].hash & MASK;
+
+            // Only shift back entries whose probe would've passed the hole.
+            if (((j - home) & MASK) >= ((j - i) & MASK))
+                slots[i] = slots[j], slots[j].lobby = nullptr, i = j;
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return !count;
+    }
+
+    template <typename F> void each(F&& fn) {
+        for (auto& slot : slots)
+            if (slot.lobby)
+                fn(*slot.lobby);
+    }
+};
+
+static thread_local LobbyTable lobbies;
+
+// TODO: fucking nuke.
+struct Grindr {
+    const std::string game_id;
+    NutPunch_Clock last_match = NutPunch_TimeNS();
+    std::unordered_map<std::string, Player, BytesHash, std::equal_to<>> players;
+    bool closing = false;
+
+    static constexpr const size_t MATCH = 2;
+
+    Grindr(const std::string& game_id) : game_id(game_id) {}
+
+    /// Times out the queue. Returns when to check on it again, or 0 once it can be deleted.
+    NutPunch_Clock expire() {
+        const NutPunch_Clock since = elapsed(last_match);
+
+        if (since <= KEEP_QUEUE_FOR)
+            return last_match + KEEP_QUEUE_FOR;
+
+        if (!closing) {
+            if (players.size() >= MATCH) // about to be matched by the next `update()`
+                return NutPunch_TimeNS() + TICK;
+
+            for (const auto& [id, player] : players) {
+                gtfo(player.pub, NPE_QueueNoMatch);
+                unqueue(player);
+            }
+
+            players.clear();
+            closing = true;
         }
 
+        if (since <= KEEP_QUEUE_FOR + GRINDR_DEBOUNCE)
+            return last_match + KEEP_QUEUE_FOR + GRINDR_DEBOUNCE;
+
+        return 0;
+    }
+
+    void accept(std::string_view peer, NP_SockAddr pub) {
+        if (players.contains(peer))
+            return;
+
+        const std::string peer_id(peer);
+        players.emplace(peer_id, Player(0, pub, {0}, peer_id));
+        closing = false;
+
+        const QueueSeat seat = {game_id, peer_id};
+        queued_by_addr.insert_or_assign(addr_key(pub), seat);
+        queued_by_peer.insert_or_assign(peer_key(peer_id.data()), seat);
+
+        NP_Info("QUEUE: Added peer '%s' (%s)", peer_id.c_str(), game_id.c_str());
+        last_match = NutPunch_TimeNS(); // necrobump
+    }
+
+    void unqueue(const Player& player) const {
+        const QueueSeat seat = {game_id, player.peer_id()};
+        unlink(queued_by_addr, addr_key(player.pub), seat);
+        unlink(queued_by_peer, peer_key(player.id), seat);
+    }
+
+    void update() {
+        if (closing)
+            return;
+
         while (players.size() >= MATCH) // highly unlikely to loop but i like taking it rough :)
             LETSGOO();
 
-        static uint8_t buf[sizeof(NP_Header) + 1] = "QUEU";
+        static thread_local uint8_t buf[sizeof(NP_Header) + 1] = "QUEU";
         uint8_t* ptr = buf + sizeof(NP_Header);
 
         const NutPunch_Clock since = elapsed(last_match),
@@ -479,104 +1494,213 @@ struct Grindr {
         auto pair2 = std::move(*players.begin());
         players.erase(players.begin());
 
+        unqueue(pair1.second), unqueue(pair2.second);
+
         std::string lobby_id;
         for (int i = 0; i < sizeof(NutPunch_LobbyName); i++)
             lobby_id.push_back((char)('A' + (std::rand() % 26)));
 
-        static uint8_t buf[sizeof(NP_Header) + sizeof(NutPunch_LobbyName)] = "DATE";
+        static thread_local uint8_t buf[sizeof(NP_Header) + sizeof(NutPunch_LobbyName)] = "DATE";
         std::memcpy(buf + sizeof(NP_Header), lobby_id.data(), sizeof(NutPunch_LobbyName));
 
         for (const auto& pub : {pair1.second.pub, pair2.second.pub})
             just_send(pub, buf, sizeof(buf));
 
-        NP_Info("QUEUE: Matched peers '%s' and '%s' to lobby '%s'", pair1.first.c_str(),
-            pair2.first.c_str(), fmt_lobby_name(lobby_id));
+        NP_Info("QUEUE: Matched peers '%s' and '%s' to lobby '%s'", pair1.first.c_str(),
+            pair2.first.c_str(), fmt_lobby_name(lobby_id.c_str()));
+    }
+};
+
+static thread_local std::unordered_map<std::string, Grindr, BytesHash, std::equal_to<>> matchmaking;
+static thread_local TimerWheel<std::string> queue_timers;
+
+static NutPunch_ErrorCode create_lobby(const LobbyId& id, NP_SockAddr pub, Lobby*& lobby) {
+    // Match against existing peers to prevent creating multiple lobbies with the same master.
+    if (seats_by_addr.contains(addr_key(pub)))
+        return NPE_LobbyExists; // fuck you...
+
+    if (lobby = lobbies.insert(id); !lobby) {
+        NP_Warn("Reached lobby limit");
+        return NPE_NoSuchLobby;
+    }
+
+    NP_Info("Created lobby '%s'", fmt_lobby_name(id.name));
+    return NPE_Ok;
+}
+
+static void send_lobby_metadata(NP_SockAddr pub, std::string_view game, std::string_view name) {
+    constexpr const size_t pnrsize = sizeof(NutPunch_LobbyName) + sizeof(NP_Metadata);
+    static thread_local uint8_t buf[sizeof(NP_Header) + pnrsize] = "LGMA";
+
+    const Lobby* lobby = lobbies.find({game, name});
+    if (!lobby)
+        return;
+
+    char* ptr = (char*)buf + sizeof(NP_Header);
+    ptr = NP_Write(ptr, lobby->id.name, sizeof(NutPunch_LobbyName));
+    ptr = lobby->metadata.dump(ptr);
+
+    just_send(pub, buf, ptr - (char*)buf);
+}
+
+static void send_lobbies(
+    NP_SockAddr pub, std::string_view game, size_t filter_count, const NutPunch_Filter* filters) {
+    constexpr const size_t fuckyou = NUTPUNCH_MAX_SEARCH_RESULTS * sizeof(NutPunch_LobbyInfo);
+    static thread_local uint8_t buf[sizeof(NP_Header) + fuckyou]
+        = "LIST"; // BITCH REFORMATS EVERY COMMIT
+
+    if (filter_count > NUTPUNCH_MAX_SEARCH_FILTERS)
+        return;
+
+    uint8_t* ptr = buf + sizeof(NP_Header);
+    size_t count = 0;
+
+    const auto listing = listings.find(game);
+    if (listing == listings.end()) {
+        just_send(pub, buf, ptr - buf);
+        return;
+    }
+
+    // Browsers keep asking the same thing over and over, so don't bother if nothing changed.
+    const std::string_view key((const char*)filters, filter_count * sizeof(NutPunch_Filter));
+    auto& replies = listing->second.replies;
+
+    if (const auto it = replies.find(key); it != replies.end()) {
+        if (it->second.epoch == listing->second.epoch) {
+            just_send(pub, it->second.bytes.data(), it->second.bytes.size());
+            return;
+        }
+    }
+
+    const auto emit = [&ptr, &count](const Lobby* lobby) {
+        std::memset(ptr, 0, sizeof(NutPunch_LobbyName));
+        std::memcpy(ptr, lobby->id.name, sizeof(NutPunch_LobbyName));
+        ptr += sizeof(NutPunch_LobbyName);
+        *ptr++ = lobby->players.size(), *ptr++ = lobby->capacity;
+        return ++count < NUTPUNCH_MAX_SEARCH_RESULTS;
+    };
+
+    // Take the candidates from whichever filter's index range is the smallest, and check the rest
+    // of the filters against them.
+    static thread_local Listing::Buckets narrowest, buckets;
+    size_t fewest = listing->second.lobbies.size();
+
+    narrowest.assign(1, &listing->second.lobbies);
+    for (size_t f = 0; f < filter_count && fewest; f++) {
+        if (!listing->second.narrow(filters[f], buckets))
+            continue;
+
+        size_t total = 0;
+        for (const auto* bucket : buckets)
+            total += bucket->size();
+
+        if (total < fewest)
+            fewest = total, std::swap(narrowest, buckets);
+    }
+
+    // Scanning the columns beats poking at that many lobbies one by one.
+    if (filter_count && fewest > listing->second.lobbies.size() / 4) {
+        listing->second.scan(filters, filter_count, emit);
+        goto done;
     }
-};
 
-static std::unordered_map<std::string, Grindr> matchmaking;
+    for (const auto* bucket : narrowest)
+        for (const auto* lobby : *bucket)
+            if (lobby->match_against(filters, filter_count) && !emit(lobby))
+                goto done;
 
-static NutPunch_ErrorCode
-create_lobby(const std::string& game, const std::string& name, NP_SockAddr pub) {
-    // Match against existing peers to prevent creating multiple lobbies with the same master.
-    for (const auto& [lobby_id, lobby] : lobbies) {
-        for (const auto& player : lobby.players)
-            if (NP_AddrEq(player.pub, pub))
-                return NPE_LobbyExists; // fuck you...
-    }
+done:
+    just_send(pub, buf, ptr - buf);
 
-    lobbies.insert_or_assign({game, name}, Lobby(game, name));
-    NP_Info("Created lobby '%s'", fmt_lobby_name(name));
-    return NPE_Ok;
+    if (replies.size() >= MAX_CACHED_LISTS && !replies.contains(key))
+        replies.clear();
+
+    auto& reply = replies[std::string(key)];
+    reply.epoch = listing->second.epoch;
+    reply.bytes.assign((const char*)buf, ptr - buf);
 }
 
-static void send_lobby_metadata(NP_SockAddr pub, const std::string& game, const std::string& name) {
-    constexpr const size_t pnrsize = sizeof(NutPunch_LobbyName) + sizeof(NP_Metadata);
-    static uint8_t buf[sizeof(NP_Header) + pnrsize] = "LGMA";
+/// Removes a player from their lobby and deletes the lobby if it's left empty. Invalidates
+/// `player` and possibly `lobby`.
+static void drop_player(Lobby& lobby, Player* player) {
+    const LobbyId id = lobby.id;
 
-    if (!lobbies.contains({game, name}))
+    const Seat seat = {id, player->index};
+    unlink(seats_by_addr, addr_key(player->pub), seat);
+    unlink(seats_by_peer, peer_key(player->id), seat);
+
+    lobby.file_special(NPSF_Players, false);
+    lobby.players.erase(player);
+    lobby.file_special(NPSF_Players, true);
+    lobby.touch();
+
+    if (!lobby) {
+        NP_Info("Deleting lobby '%s'", lobby.fmt_id());
+        lobby.set_unlisted(true);
+        lobbies.erase(id);
+    }
+}
+
+/// Kicks whoever sits in `seat`, logging `why` first.
+static void unseat(const Seat seat, const char* why) {
+    Lobby* lobby = lobbies.find(seat.lobby);
+    if (!lobby)
         return;
 
-    const auto& lobby = lobbies.at({game, name});
+    auto& players = lobby->players;
+    const auto player = std::find_if(players.begin(), players.end(),
+        [&seat](const auto& player) { return player.index == seat.index; });
 
-    char* ptr = (char*)buf + sizeof(NP_Header);
-    ptr = NP_Write(ptr, name.data(), sizeof(NutPunch_LobbyName));
-    ptr = lobby.metadata.dump(ptr);
+    if (player == players.end())
+        return;
 
-    just_send(pub, buf, ptr - (char*)buf);
+    NP_Info("Player %d %s", seat.index + 1, why);
+    drop_player(*lobby, player);
 }
 
-static void send_lobbies(
-    NP_SockAddr pub, const std::string& game, size_t filter_count, const NutPunch_Filter* filters) {
-    constexpr const size_t fuckyou = NUTPUNCH_MAX_SEARCH_RESULTS * sizeof(NutPunch_LobbyInfo);
-    static uint8_t buf[sizeof(NP_Header) + fuckyou] = "LIST"; // BITCH REFORMATS EVERY COMMIT
-
-    if (filter_count > NUTPUNCH_MAX_SEARCH_FILTERS)
+/// A peer can only sit in a single lobby; drop them from any other one they're still in.
+static void unseat_elsewhere(std::string_view peer_id, const LobbyId& lobby) {
+    const auto it = seats_by_peer.find(peer_key(peer_id.data()));
+    if (it == seats_by_peer.end() || it->second.lobby == lobby)
         return;
 
-    uint8_t* ptr = buf + sizeof(NP_Header);
-    size_t count = 0;
+    unseat(it->second, "moved to another lobby");
+}
 
-    for (const auto& [id, lobby] : lobbies) {
-        if (lobby.unlisted || lobby.game != game || !lobby.match_against(filters, filter_count))
-            continue;
+static void kill_bro(const char* peer_id, NP_SockAddr pub) {
+    const uint64_t keys[] = {peer_key(peer_id), addr_key(pub)};
 
-        std::memcpy(ptr, id.name.data(), std::strlen(lobby.fmt_id()));
-        ptr += sizeof(NutPunch_LobbyName);
-        *ptr++ = lobby.players.size(), *ptr++ = lobby.capacity;
+    for (auto* index : {&seats_by_peer, &seats_by_addr}) {
+        const auto it = index->find(keys[index == &seats_by_addr]);
+        if (it == index->end())
+            continue;
 
-        if (++count >= NUTPUNCH_MAX_SEARCH_RESULTS)
-            break;
+        unseat(it->second, "disconnected gracefully");
     }
 
-    just_send(pub, buf, ptr - buf);
-}
+    for (auto* index : {&queued_by_peer, &queued_by_addr}) {
+        const auto it = index->find(keys[index == &queued_by_addr]);
+        if (it == index->end())
+            continue;
 
-static void kill_bro(const NutPunch_PeerId peer_id, NP_SockAddr pub) {
-    for (auto& [id, lobby] : lobbies)
-        lobby.kill_bro(peer_id, pub);
+        const QueueSeat seat = it->second;
+        const auto queue = matchmaking.find(seat.game);
 
-    for (auto& [id, queue] : matchmaking) {
-        std::erase_if(queue.players, [peer_id, pub](const auto& pair) {
-            const auto& [id, player] = pair;
+        if (queue == matchmaking.end() || !queue->second.players.contains(seat.peer)) {
+            index->erase(it);
+            continue;
+        }
 
-            if (!NP_AddrEq(player.pub, pub) && id != peer_id)
-                return false;
+        auto& players = queue->second.players;
+        queue->second.unqueue(players.at(seat.peer));
+        players.erase(seat.peer);
 
-            NP_Info("QUEUE: Peer '%s' disconnected", id.c_str());
-            return true;
-        });
+        NP_Info("QUEUE: Peer '%s' disconnected", seat.peer.c_str());
     }
 }
 
-struct Packet {
-    const char* const header;
-    void (*const handle)(Message msg);
-    const size_t min_size;
-};
-
 static void handle_ping(Message msg) {
-    static uint8_t buf[sizeof(NP_Header) + 1] = "PONG";
+    static thread_local uint8_t buf[sizeof(NP_Header) + 1] = "PONG";
     buf[sizeof(NP_Header)] = *msg.data++;
     just_send(msg.from, buf, sizeof(buf));
 }
@@ -600,10 +1724,14 @@ static void handle_find(Message msg) {
     const auto peer_id = msg.read(sizeof(NutPunch_PeerId));
     const auto game_id = msg.read0term(sizeof(NutPunch_GameId));
 
-    if (!matchmaking.contains(game_id))
-        matchmaking.emplace(game_id, Grindr(game_id));
+    auto queue = matchmaking.find(game_id);
+    if (queue == matchmaking.end()) {
+        const std::string game(game_id);
+        queue = matchmaking.emplace(game, Grindr(game)).first;
+        queue_timers.schedule(queue->second.last_match + KEEP_QUEUE_FOR, game);
+    }
 
-    matchmaking.at(game_id).accept(peer_id, msg.from);
+    queue->second.accept(peer_id, msg.from);
 }
 
 static void handle_disc(Message msg) {
@@ -616,21 +1744,17 @@ static void handle_join(Message msg) {
     const auto lobby_name = msg.read0term(sizeof(NutPunch_LobbyName));
     const auto flags = msg.read<NP_HeartbeatFlagsStorage>();
 
+    const LobbyId id(game, lobby_name);
+    Lobby* lobby = lobbies.find(id);
     NutPunch_ErrorCode err = NPE_Ok;
 
-    if (lobbies.contains({game, lobby_name})) {
-        if (!(flags & (NP_HB_JoinExisting | NP_HB_Queue))
-            && !lobbies[{game, lobby_name}].has(peer_id))
-        {
+    if (lobby) {
+        if (!(flags & (NP_HB_JoinExisting | NP_HB_Queue)) && !lobby->has(peer_id))
             err = NPE_LobbyExists;
-        }
     } else if (flags & NP_HB_JoinExisting) {
         err = NPE_NoSuchLobby;
-    } else if (lobbies.size() >= MAX_LOBBIES) {
-        err = NPE_NoSuchLobby;
-        NP_Warn("Reached lobby limit");
     } else {
-        err = create_lobby(game, lobby_name, msg.from);
+        err = create_lobby(id, msg.from, lobby);
     }
 
     if (err != NPE_Ok) {
@@ -638,15 +1762,13 @@ static void handle_join(Message msg) {
         return;
     }
 
-    auto& lobby = lobbies.at({game, lobby_name});
-
     if (flags & NP_HB_Queue) // unhack the initial capacity of 1...
-        lobby.capacity = Grindr::MATCH;
+        lobby->set_capacity(Grindr::MATCH);
 
-    lobby.accept(peer_id, flags, msg);
+    lobby->accept(peer_id, flags, msg);
 }
 
-static void handle_recv(NP_SockAddr pub, const char* buf, int rcv) {
+static void dispatch(NP_SockAddr pub, const char* buf, int rcv) {
     rcv -= 4 + (int)sizeof(NP_Header);
     if (rcv < 0)
         return; // junk...
@@ -654,25 +1776,246 @@ static void handle_recv(NP_SockAddr pub, const char* buf, int rcv) {
     // we completely ignore the packet id on the NutPuncher side for now
     buf += 4;
 
-    constexpr const Packet packets[] = {
-        {"PING", handle_ping,  1                         },
-        {"LIST", handle_list,  sizeof(NutPunch_GameId)   },
-        {"LGMA", handle_ligma, sizeof(NutPunch_LobbyName)},
-        {"FIND", handle_find,  sizeof(NP_Find)           },
-        {"DISC", handle_disc,  sizeof(NutPunch_PeerId)   },
-        {"JOIN", handle_join,  sizeof(NP_Heartbeat)      },
-    };
+    void (*handle)(Message) = nullptr;
+    size_t min_size = 0;
+
+    switch (NP_ReadOpcode(buf)) {
+    case NP_Opcode('P', 'I', 'N', 'G'): handle = handle_ping, min_size = 1; break;
+    case NP_Opcode('L', 'I', 'S', 'T'):
+        handle = handle_list, min_size = sizeof(NutPunch_GameId);
+        break;
+    case NP_Opcode('L', 'G', 'M', 'A'):
+        handle = handle_ligma, min_size = sizeof(NutPunch_LobbyName);
+        break;
+    case NP_Opcode('F', 'I', 'N', 'D'): handle = handle_find, min_size = sizeof(NP_Find); break;
+    case NP_Opcode('D', 'I', 'S', 'C'):
+        handle = handle_disc, min_size = sizeof(NutPunch_PeerId);
+        break;
+    case NP_Opcode('J', 'O', 'I', 'N'):
+        handle = handle_join, min_size = sizeof(NP_Heartbeat);
+        break;
+    default: return;
+    }
 
-    for (const auto& packet : packets) {
-        if (rcv >= packet.min_size && !memcmp(buf, packet.header, sizeof(NP_Header))) {
-            packet.handle({pub, buf + sizeof(NP_Header), rcv});
-            return;
+    if ((size_t)rcv >= min_size)
+        handle({pub, buf + sizeof(NP_Header), rcv});
+}
+
+/// A packet handed over from the shard that received it to the shard that owns its game.
+struct Forward {
+    NP_SockAddr from;
+    int len;
+    char data[NUTPUNCH_FRAGMENT_SIZE];
+};
+
+struct Shard {
+    NP_Sock sock = NUTPUNCH_INVALID_SOCKET;
+    int wake = -1; // eventfd poked after forwarding (epoll mode only)
+
+    std::mutex lock;
+    std::vector<Forward> inbox;
+};
+
+/// Populated once in `main` before any worker starts, so it's safe to read without locking.
+static std::vector<std::unique_ptr<Shard>> shards;
+
+/// Multiplier for the steering hash. Has to stay in sync with the BPF program in `steer`.
+static constexpr const uint32_t STEER_PRIME = 0x01000193;
+
+/// Hashes a game ID into its owner shard. Bytes past the null terminator are ignored, so junk
+/// left in a client's buffer can at worst cost a cross-shard forward.
+static size_t shard_of(const char* raw) {
+    NutPunch_GameId game = {0};
+    memcpy(game, raw, strnlen(raw, sizeof(game)));
+
+    uint32_t hash = 0;
+    for (size_t i = 0; i < sizeof(game); i += 4) {
+        uint32_t word = 0;
+        memcpy(&word, game + i, sizeof(word));
+        hash = (hash ^ ntohl(word)) * STEER_PRIME;
+    }
+
+    return hash % shards.size();
+}
+
+static constexpr const size_t EVERY_SHARD = SIZE_MAX;
+
+/// Returns the shard owning the packet's game, `EVERY_SHARD` for a DISC (it only carries a peer
+/// ID), or the current shard for everything else.
+static size_t route(const char* buf, int rcv) {
+    if (shards.size() < 2 || rcv < 4 + (int)sizeof(NP_Header))
+        return SHARD;
+
+    size_t offset = 0;
+
+    switch (NP_ReadOpcode(buf + 4)) {
+    case NP_Opcode('J', 'O', 'I', 'N'):
+    case NP_Opcode('F', 'I', 'N', 'D'): offset = sizeof(NutPunch_PeerId); break;
+    case NP_Opcode('L', 'I', 'S', 'T'):
+    case NP_Opcode('L', 'G', 'M', 'A'): break;
+    case NP_Opcode('D', 'I', 'S', 'C'): return EVERY_SHARD;
+    default: return SHARD;
+    }
+
+    offset += 4 + sizeof(NP_Header);
+    if ((size_t)rcv < offset + sizeof(NutPunch_GameId))
+        return SHARD; // junk, but let `dispatch` deal with it
+
+    return shard_of(buf + offset);
+}
+
+static void forward(size_t target, NP_SockAddr from, const char* buf, int rcv) {
+    if (rcv < 0 || (size_t)rcv > sizeof(Forward::data))
+        return; // nothing legit is this fat
+
+    Shard& shard = *shards[target];
+
+    {
+        std::lock_guard<std::mutex> _(shard.lock);
+        Forward& fwd = shard.inbox.emplace_back();
+        fwd.from = from, fwd.len = rcv;
+        memcpy(fwd.data, buf, rcv);
+    }
+
+#ifdef NUTPUNCH_EPOLL
+    const uint64_t one = 1;
+    if (write(shard.wake, &one, sizeof(one)) < 0)
+        NP_Warn("Failed to wake shard %zu (%d)", target, errno);
+#endif
+}
+
+/// Handles packets other shards forwarded to us.
+static void drain_inbox() {
+    static thread_local std::vector<Forward> pending;
+    Shard& shard = *shards[SHARD];
+
+    {
+        std::lock_guard<std::mutex> _(shard.lock);
+        pending.swap(shard.inbox);
+    }
+
+    for (const auto& fwd : pending)
+        dispatch(fwd.from, fwd.data, fwd.len);
+    pending.clear();
+}
+
+static void handle_recv(NP_SockAddr pub, const char* buf, int rcv) {
+    const size_t owner = route(buf, rcv);
+
+    if (owner == SHARD) {
+        dispatch(pub, buf, rcv);
+        return;
+    }
+
+    if (owner != EVERY_SHARD) {
+        forward(owner, pub, buf, rcv);
+        return;
+    }
+
+    for (size_t i = 0; i < shards.size(); i++) {
+        if (i == SHARD)
+            dispatch(pub, buf, rcv);
+        else
+            forward(i, pub, buf, rcv);
+    }
+}
+
+static void warn_recv_error() {
+    const int err = NP_SockError();
+    if (err != NP_WouldBlock && err != NP_TooFat && err != NP_ConnReset)
+        NP_Warn("recvfrom fail: %d", err);
+}
+
+#ifdef NUTPUNCH_MMSG
+
+/// The biggest GRO-coalesced datagram train the kernel can hand us in one go.
+static constexpr const size_t GRO_SIZE = 65535;
+
+static thread_local bool gro = false;
+
+static void setup_gro() {
+#ifdef UDP_GRO
+    const int on = 1;
+    gro = !setsockopt(SOCK, IPPROTO_UDP, UDP_GRO, &on, sizeof(on));
+    if (gro)
+        NP_Info("UDP GRO enabled");
+#endif
+}
+
+/// Returns the GRO segment size of a received datagram train, or 0 if it wasn't coalesced.
+static size_t gro_segment(const struct msghdr& hdr) {
+#ifdef UDP_GRO
+    for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR((struct msghdr*)&hdr, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int segment = 0;
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+            return segment > 0 ? (size_t)segment : 0;
+        }
+    }
+#endif
+    return 0;
+}
+
+static void receive() {
+    static thread_local struct mmsghdr msgs[BATCH_SIZE] = {};
+    static thread_local struct iovec iovs[BATCH_SIZE] = {};
+    static thread_local NP_SockAddr addrs[BATCH_SIZE] = {};
+    static thread_local char control[BATCH_SIZE][CMSG_SPACE(sizeof(int))] = {};
+    static thread_local std::vector<char> bufs;
+
+    const size_t slot = gro ? GRO_SIZE : NUTPUNCH_FRAGMENT_SIZE;
+    if (bufs.size() != BATCH_SIZE * slot)
+        bufs.resize(BATCH_SIZE * slot);
+
+    for (;;) {
+        for (size_t i = 0; i < BATCH_SIZE; i++) {
+            iovs[i] = {bufs.data() + i * slot, slot};
+
+            auto& hdr = msgs[i].msg_hdr;
+            hdr = {};
+            hdr.msg_name = &addrs[i], hdr.msg_namelen = sizeof(NP_SockAddr);
+            hdr.msg_iov = &iovs[i], hdr.msg_iovlen = 1;
+
+            if (gro)
+                hdr.msg_control = control[i], hdr.msg_controllen = sizeof(control[i]);
+        }
+
+        const int count = recvmmsg(SOCK, msgs, BATCH_SIZE, 0, nullptr);
+        if (count < 0) {
+            warn_recv_error();
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            const auto& hdr = msgs[i].msg_hdr;
+            if (hdr.msg_flags & MSG_TRUNC)
+                continue; // junk...
+
+            const char* buf = (const char*)iovs[i].iov_base;
+            const size_t len = msgs[i].msg_len, segment = gro ? gro_segment(hdr) : 0;
+
+            if (!segment) {
+                handle_recv(addrs[i], buf, (int)len);
+                continue;
+            }
+
+            for (size_t offset = 0; offset < len; offset += segment)
+                handle_recv(addrs[i], buf + offset, (int)std::min(segment, len - offset));
         }
+
+        if (count < (int)BATCH_SIZE)
+            break;
     }
+
+    flush_sends();
 }
 
+#else
+
+static void setup_gro() {}
+
 static void receive() {
-    static char buf[NUTPUNCH_FRAGMENT_SIZE] = {0};
+    static thread_local char buf[NUTPUNCH_FRAGMENT_SIZE] = {0};
 
     for (;;) {
         NP_SockAddr addr = {0};
@@ -680,12 +2023,7 @@ static void receive() {
         int size = recvfrom(SOCK, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&addr, &addr_size);
 
         if (size < 0) {
-            if (NP_SockError() != NP_WouldBlock && NP_SockError() != NP_TooFat
-                && NP_SockError() != NP_ConnReset)
-            {
-                NP_Warn("recvfrom fail: %d", NP_SockError());
-            }
-
+            warn_recv_error();
             break;
         }
 
@@ -693,30 +2031,238 @@ static void receive() {
     }
 }
 
+#endif
+
+static void expire_player(const PlayerTimer& timer) {
+    Lobby* lobby = lobbies.find(timer.lobby);
+    if (!lobby)
+        return;
+
+    auto& players = lobby->players;
+    const auto player = std::find_if(players.begin(), players.end(),
+        [&timer](const auto& player) { return player.serial == timer.serial; });
+
+    if (player == players.end())
+        return; // left or got kicked already
+
+    if (elapsed(player->last_beat) < PEER_TIMEOUT) {
+        player_timers.schedule(player->last_beat + PEER_TIMEOUT, timer);
+        return;
+    }
+
+    NP_Info("%.*s timed out", (int)sizeof(player->id), player->id);
+    drop_player(*lobby, player);
+}
+
 static void update_lobbies() {
-    for (auto& [id, lobby] : lobbies)
-        lobby.update();
+    player_timers.advance(NutPunch_TimeNS(), expire_player);
 
-    std::erase_if(lobbies, [](const auto& kv) {
-        const auto& lobby = kv.second;
-        if (lobby)
-            return false;
-        NP_Info("Deleting lobby '%s'", lobby.fmt_id());
-        return true;
-    });
+    lobbies.each([](Lobby& lobby) { lobby.update(); });
+}
+
+static void expire_queue(const std::string& game) {
+    const auto it = matchmaking.find(game);
+    if (it == matchmaking.end())
+        return;
+
+    if (const NutPunch_Clock next = it->second.expire()) {
+        queue_timers.schedule(next, game);
+        return;
+    }
+
+    NP_Info("QUEUE: Deleting queue '%s'", game.c_str());
+    matchmaking.erase(it);
 }
 
 static void update_grindr() {
+    queue_timers.advance(NutPunch_TimeNS(), expire_queue);
+
     for (auto& [id, queue] : matchmaking)
         queue.update();
+}
 
-    std::erase_if(matchmaking, [](const auto& pair) {
-        const auto& [id, queue] = pair;
-        if (queue)
-            return false;
-        NP_Info("QUEUE: Deleting queue '%s'", id.c_str());
-        return true;
-    });
+static void tick() {
+    update_grindr();
+    update_lobbies();
+    flush_sends();
+}
+
+#ifdef NUTPUNCH_EPOLL
+
+static bool arm_ticks(int timer, bool on) {
+    struct itimerspec spec = {};
+
+    if (on) {
+        spec.it_value.tv_sec = spec.it_interval.tv_sec = (time_t)(TICK / NUTPUNCH_SEC);
+        spec.it_value.tv_nsec = spec.it_interval.tv_nsec = (long)(TICK % NUTPUNCH_SEC);
+    }
+
+    return !timerfd_settime(timer, 0, &spec, nullptr);
+}
+
+/// Handles packets the moment they arrive and ticks off a timerfd, which is disarmed while there
+/// are no lobbies or queues to update so an idle NutPuncher doesn't wake up at all.
+static int run() {
+    const int epoll = epoll_create1(EPOLL_CLOEXEC),
+              timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (epoll < 0 || timer < 0) {
+        NP_Warn("Failed to set up epoll (%d)", errno);
+        return EXIT_FAILURE;
+    }
+
+    const int wake = shards[SHARD]->wake;
+
+    for (const int fd : {(int)SOCK, timer, wake}) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN, ev.data.fd = fd;
+
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev)) {
+            NP_Warn("Failed to register fd %d with epoll (%d)", fd, errno);
+            return EXIT_FAILURE;
+        }
+    }
+
+    bool ticking = false;
+
+    for (;;) {
+        const bool busy = !lobbies.empty() || !matchmaking.empty();
+        if (busy != ticking && arm_ticks(timer, busy))
+            ticking = busy;
+
+        struct epoll_event events[3] = {};
+        const int count = epoll_wait(epoll, events, 3, -1);
+
+        if (count < 0 && errno != EINTR) {
+            NP_Warn("epoll_wait fail: %d", errno);
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < count; i++) {
+            uint64_t junk = 0;
+
+            if (events[i].data.fd == timer) {
+                if (read(timer, &junk, sizeof(junk)) > 0)
+                    tick();
+            } else if (events[i].data.fd == wake) {
+                if (read(wake, &junk, sizeof(junk)) > 0)
+                    drain_inbox(), flush_sends();
+            } else if (SOCK == NUTPUNCH_INVALID_SOCKET) {
+                NP_Warn("SOCKET DIED!!!");
+                return EXIT_FAILURE;
+            } else {
+                receive();
+            }
+        }
+    }
+}
+
+#else
+
+static int run() {
+    for (;;) {
+        const NutPunch_Clock start = NutPunch_TimeNS();
+
+        if (SOCK == NUTPUNCH_INVALID_SOCKET) {
+            NP_Warn("SOCKET DIED!!!");
+            return EXIT_FAILURE;
+        }
+
+        receive();
+        drain_inbox();
+        tick();
+
+        const NutPunch_Clock delta = elapsed(start);
+        if (delta < TICK)
+            NP_SleepMs((TICK - delta) / NUTPUNCH_MS);
+    }
+}
+
+#endif
+
+#ifdef NUTPUNCH_STEERING
+
+/// Attaches a classic BPF program to the shards' `SO_REUSEPORT` group which hashes the game ID
+/// of JOIN/FIND/LIST/LGMA packets the same way `shard_of` does, so they land straight on the
+/// socket of the owning shard. Anything else gets an out-of-range index, which makes the kernel
+/// fall back to its usual 4-tuple hash.
+static bool steer(NP_Sock sock, uint32_t count) {
+    // two to reset the hash, five per word of the game ID, and two to finish it off
+    static_assert(sizeof(NutPunch_GameId) % 4 == 0);
+    constexpr const uint32_t HASH_LEN = 2 + 5 * (sizeof(NutPunch_GameId) / 4) + 2;
+    constexpr const uint32_t join = 6, list = join + HASH_LEN;
+
+    const auto header = [](const char* x) {
+        return (uint32_t)(uint8_t)x[0] << 24 | (uint32_t)(uint8_t)x[1] << 16
+               | (uint32_t)(uint8_t)x[2] << 8 | (uint32_t)(uint8_t)x[3];
+    };
+
+    std::vector<struct sock_filter> code = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, header("JOIN"), join - 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, header("FIND"), join - 3, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, header("LIST"), list - 4, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, header("LGMA"), list - 5, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),
+    };
+
+    for (const uint32_t start : {4 + sizeof(NP_Header) + sizeof(NutPunch_PeerId),
+             4 + sizeof(NP_Header)})
+    {
+        code.push_back(BPF_STMT(BPF_LD | BPF_IMM, 0));
+        code.push_back(BPF_STMT(BPF_ST, 0));
+
+        for (uint32_t i = 0; i < sizeof(NutPunch_GameId); i += 4) {
+            code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS, start + i));
+            code.push_back(BPF_STMT(BPF_LDX | BPF_MEM, 0));
+            code.push_back(BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0));
+            code.push_back(BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, STEER_PRIME));
+            code.push_back(BPF_STMT(BPF_ST, 0));
+        }
+
+        code.push_back(BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count));
+        code.push_back(BPF_STMT(BPF_RET | BPF_A, 0));
+    }
+
+    struct sock_fprog prog = {};
+    prog.len = (unsigned short)code.size(), prog.filter = code.data();
+    return !setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+#endif
+
+static NP_Sock open_socket(bool reuse_port) {
+    NP_Sock sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == NUTPUNCH_INVALID_SOCKET || !NP_MakeNonblocking(sock) || !NP_MakeReuseAddr(sock))
+        goto fail;
+
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        const int on = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (const char*)&on, sizeof(on)))
+            goto fail;
+    }
+#endif
+
+    {
+        NP_SockAddr local = {0};
+        local.sin_family = AF_INET;
+        local.sin_port = htons(NUTPUNCH_SERVER_PORT);
+        local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if (!bind(sock, (struct sockaddr*)&local, sizeof(local)))
+            return sock;
+    }
+
+fail:
+    NP_NukeSocket(&sock);
+    return NUTPUNCH_INVALID_SOCKET;
+}
+
+static int run_shard(size_t idx) {
+    SHARD = idx, SOCK = shards[idx]->sock;
+    setup_gro();
+    return run();
 }
 
 struct Guard {
@@ -736,48 +2282,54 @@ struct Guard {
     }
 };
 
-int main(int argc, char*[]) {
+int main(int argc, char* argv[]) {
     if (argc == 4) { // deploy-script hack to print the server port
         std::printf("%d\n", NUTPUNCH_SERVER_PORT);
         return EXIT_SUCCESS;
     }
 
-    std::srand(NutPunch_TimeNS());
-    Guard _linganguliguliguli;
-
-    SOCK = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if (SOCK == NUTPUNCH_INVALID_SOCKET || !NP_MakeNonblocking(SOCK) || !NP_MakeReuseAddr(SOCK))
+    size_t count = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1;
+    if (count < 1 || count > MAX_SHARDS) {
+        NP_Warn("Shard count must be between 1 and %zu", MAX_SHARDS);
         return EXIT_FAILURE;
+    }
 
-    {
-        NP_SockAddr local = {0};
-        local.sin_family = AF_INET;
-        local.sin_port = htons(NUTPUNCH_SERVER_PORT);
-        local.sin_addr.s_addr = htonl(INADDR_ANY);
-
-        if (bind(SOCK, (struct sockaddr*)&local, sizeof(local)))
-            return EXIT_FAILURE;
+#ifndef SO_REUSEPORT
+    if (count > 1) {
+        NP_Warn("No SO_REUSEPORT on this platform; running a single shard");
+        count = 1;
     }
+#endif
 
-    constexpr const NutPunch_Clock MIN_DELTA = NUTPUNCH_SEC / 30;
-    NP_Info("Running on port %d", NUTPUNCH_SERVER_PORT);
+    std::srand(NutPunch_TimeNS());
+    Guard _linganguliguliguli;
 
-    for (;;) {
-        const NutPunch_Clock start = NutPunch_TimeNS();
+    for (size_t i = 0; i < count; i++) {
+        auto& shard = *shards.emplace_back(std::make_unique<Shard>());
 
-        if (SOCK == NUTPUNCH_INVALID_SOCKET) {
-            NP_Warn("SOCKET DIED!!!");
+        shard.sock = open_socket(count > 1);
+        if (shard.sock == NUTPUNCH_INVALID_SOCKET)
             return EXIT_FAILURE;
-        }
 
-        receive();
-        update_grindr();
-        update_lobbies();
+#ifdef NUTPUNCH_EPOLL
+        shard.wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (shard.wake < 0)
+            return EXIT_FAILURE;
+#endif
+    }
 
-        const NutPunch_Clock delta = elapsed(start);
-        if (delta < MIN_DELTA)
-            NP_SleepMs((MIN_DELTA - delta) / NUTPUNCH_MS);
+#ifdef NUTPUNCH_STEERING
+    if (count > 1 && !steer(shards[0]->sock, (uint32_t)count))
+        NP_Warn("Failed to attach the steering program (%d); forwarding across shards", errno);
+#endif
+
+    for (size_t i = 1; i < count; i++) {
+        std::thread([i]() {
+            if (run_shard(i) != EXIT_SUCCESS)
+                std::quick_exit(EXIT_FAILURE); // take the whole thing down for a restart
+        }).detach();
     }
 
-    return EXIT_SUCCESS;
+    NP_Info("Running on port %d with %zu shard(s)", NUTPUNCH_SERVER_PORT, count);
+    return run_shard(0);
 }
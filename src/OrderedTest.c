@@ -0,0 +1,113 @@
+// Checks that an ordered channel keeps going after a reliable message on it is given up on. Talks
+// to itself as peer 1 over loopback against a fake clock, so there's no NutPuncher involved.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+static uint64_t fake_now = 1000 * 1000000000ull;
+static uint64_t fake_clock() {
+    return fake_now;
+}
+
+enum {
+    CHAN,
+    LOST = 2, // every send of this one gets dropped
+    COUNT = 10,
+};
+
+/// Drops the DATA packets carrying message `LOST`, going by the channel sequence number.
+static ssize_t lossy_sendto(int sock, const void* buf, size_t len, int flags,
+    const struct sockaddr* dest, socklen_t dest_len) {
+    const uint8_t* const data = (const uint8_t*)buf;
+    const size_t seq_at = 4 + 4 + 16 + 1;
+
+    if (len >= seq_at + 2 && !memcmp(data + 4, "DATA", 4) && data[seq_at - 1] == CHAN
+        && data[seq_at] == 0 && data[seq_at + 1] == LOST)
+    {
+        return (ssize_t)len;
+    }
+
+    return sendto(sock, buf, len, flags, dest, dest_len);
+}
+
+#define NutPunch_TimeNS fake_clock
+#define sendto lossy_sendto
+#define NUTPUNCH_IMPLEMENTATION
+#include <NutPunch.h>
+#undef sendto
+
+static int expected = 0;
+
+static bool drain() {
+    while (NutPunch_HasMessage(CHAN)) {
+        int got = -1, size = sizeof(got);
+        NutPunch_NextMessage(CHAN, &got, &size);
+
+        if (expected == LOST)
+            expected++;
+        if (got != expected) {
+            NP_Warn("Expected message %d, got %d", expected, got);
+            return false;
+        }
+
+        expected++;
+    }
+
+    return true;
+}
+
+/// Runs the send/receive loop in 100 ms steps until `until` messages are in.
+static bool pump(int until) {
+    for (int i = 0; i < 1000 && expected < until; i++) {
+        fake_now += 100 * NUTPUNCH_MS;
+        NutPunch_Flush();
+        NP_ReceiveShit();
+
+        if (!drain())
+            return false;
+    }
+
+    if (expected < until) {
+        NP_Warn("Stuck waiting for message %d", expected);
+        return false;
+    }
+
+    return true;
+}
+
+int main() {
+    NutPunch_SetServerAddr("127.0.0.1");
+    if (!NutPunch_QueryMode())
+        return EXIT_FAILURE;
+
+    NutPunch_SetChannelCount(1);
+    NutPunch_SetChannelMode(CHAN, NPCM_Ordered);
+
+    // we're peer 0, and peer 1 is our own socket
+    NP_SockAddr self = {0};
+    socklen_t self_size = sizeof(self);
+    getsockname(NP_Socket, (struct sockaddr*)&self, &self_size);
+    self.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    NP_LocalPeer = 0, NP_Peers[1].address = self;
+
+    for (int i = 0; i < COUNT; i++)
+        NutPunch_SendReliably(CHAN, 1, &i, sizeof(i));
+
+    if (!pump(COUNT))
+        return EXIT_FAILURE;
+
+    // and it keeps going afterwards
+    const int last = COUNT;
+    NutPunch_SendReliably(CHAN, 1, &last, sizeof(last));
+
+    if (!pump(COUNT + 1))
+        return EXIT_FAILURE;
+
+    NP_Info("Got everything in order past the message that never made it");
+    NutPunch_Shutdown();
+    return EXIT_SUCCESS;
+}